@@ -2,17 +2,35 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
 #include <unistd.h> // for usleep function
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#undef BLOCK_SIZE // pulled in from linux/fs.h, ours is the payload size
+#endif
 
 #define ROWS 5
 #define COLUMNS 10
-#define DISK_SIZE (ROWS * COLUMNS)
 #define FILE_COUNT 10
+#define BLOCK_SIZE 4096              // Bytes of payload per block
+#define SCRATCH_BLOCK diskSize       // Reserved block past the end of the disk, used as scratch when the disk is full
+#define DISK_MAGIC 0x47415246u       // "FRAG"
+#define DISK_VERSION 3
+#define DEFAULT_MOVE_DELAY_MS 200    // Slow enough to follow each block on the name map
 
 typedef struct
 {
-    char fileName[20];  // File block info, empty if the block doesn't contain a part of a file
+    int fileId;         // ID of the file the block belongs to, -1 if the block doesn't contain a part of a file
     int nextBlockIndex; // Index to the next block, -1 if it's the last block
+    int prevBlockIndex; // Index to the previous block, -1 if it's the first block
     int occupied;       // Whether the block is occupied
 } DiskBlock;
 
@@ -21,330 +39,3375 @@ typedef struct
     char fileName[20];
     char creationDate[20];
     int firstBlockIndex;
+    int used;            // Whether the slot holds a file; a file's ID is its slot and never changes
+    int nextFreeId;      // Next slot on the free list while the slot is unused, -1 at the end
+    int blockCount;      // Blocks in the file's chain
+    int contiguousLinks; // Links to the next block on disk, the file has blockCount - contiguousLinks extents
 } FileInfo;
 
-int numberOfFiles = FILE_COUNT;
-DiskBlock disk[ROWS][COLUMNS];
-FileInfo files[FILE_COUNT];
+// Disk image layout: header, block table, payload blocks, file table. The block table and the payload
+// area both hold one extra entry for the scratch block. Everything is used in place through one mapping.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t blockSize;
+    uint32_t blockRecordSize; // sizeof(DiskBlock), so images from an incompatible build are rejected
+    int32_t rows;
+    int32_t columns;
+    int32_t fileCapacity;  // Slots in the file table, doubled when they run out
+    int32_t fileCount;     // Files in use
+    int32_t fileSlotsUsed; // Slots handed out so far, IDs below this are either in use or on the free list
+    int32_t freeFileHead;  // First slot of the free list, -1 if it's empty
+    uint64_t blockTableOffset;
+    uint64_t payloadOffset;
+    uint64_t fileTableOffset;
+    uint64_t imageSize;
+    int32_t journalWavesDone; // Waves of the journaled defrag in progress that have run, zero in older images
+    int32_t fileCountsSaved;  // Set by a clean close: the block and link counts in the file table match the chains
+} DiskHeader;
+
+DiskHeader *diskHeader;
+DiskBlock *disk;              // diskSize + 1 blocks, the last one is the scratch block
+FileInfo *files;              // fileCapacity entries, indexed by file ID
+unsigned char *blockPayloads; // diskSize + 1 payloads of BLOCK_SIZE bytes
+int diskRows, diskColumns, diskSize;
+int imageFd = -1;       // -1 when the disk only lives in memory
+int renderEnabled = 1;  // Animate defrag moves, off when running headless
+int moveDelayMs = DEFAULT_MOVE_DELAY_MS; // Pause after each move shown on the name map, 0 for no pause
+
+pthread_mutex_t diskLock = PTHREAD_MUTEX_INITIALIZER; // Guards the block table, file table and payloads
+unsigned long diskVersion = 0;                        // Bumped by every change that invalidates a defrag plan
+
+// Name to file ID index: open addressing with linear probing, kept in memory and built from the file table by
+// the first lookup after an image is opened
+typedef struct
+{
+    int *slots;   // File IDs, -1 for an empty slot
+    int capacity; // Always a power of two
+    int count;
+} FileIndex;
+
+FileIndex fileIndex;
+
+// Fragmentation metrics, kept up to date by every allocate, free and move so they can be read in O(1).
+// In memory only. The file totals are summed from the file table when an image is opened, and the free space
+// side is built from the block table the first time something asks about free space.
+typedef struct
+{
+    long totalExtents;   // Runs of consecutive blocks summed over all files
+    long fileBlocks;     // Blocks owned by files
+    int nonEmptyFiles;   // Files with at least one block
+    int fragmentedFiles; // Files with more than one extent
+    int freeBlocks;
+    int freeRuns;        // Maximal runs of free blocks
+    int leaves;          // Leaves of the free run tree, a power of two >= diskSize, 0 until the tree is built
+    int *runPrefix;      // Per tree node: free run starting at its left edge,
+    int *runSuffix;      // free run ending at its right edge
+    int *runLongest;     // and longest free run inside it
+} FragmentationMetrics;
+
+FragmentationMetrics metrics;
+
+// Move journal counters, for one sequential defrag or summed over a workload
+typedef struct
+{
+    long groups;           // Group commits, one write and one fdatasync each
+    long waves;
+    long moves;
+    long bytes;
+    long checkpoints;
+    double journalSeconds; // Spent writing and syncing the journal and msyncing checkpoints
+    double runSeconds;     // Whole journaled runs, journal time included
+} JournalStats;
+
+// Write-ahead journal of sequential defrag moves on an image file, see the move journal section
+typedef struct
+{
+    int fd;                // -1 when defrags aren't journaled
+    char *path;            // The image path with .journal appended
+    unsigned char *buffer; // Records waiting for the next write
+    size_t bufferUsed, bufferCapacity;
+    int interrupted;       // The journal held records when the image was opened
+    int recoveredWaves;    // Journaled waves that hadn't run, finished on opening
+    long recoveredMoves;
+    JournalStats run, total;
+} MoveJournal;
+
+MoveJournal journal = {.fd = -1};
+int journalEnabled = 1; // Off with --no-journal
+
+typedef struct
+{
+    int from; // Block index the data is read from
+    int to;   // Block index the data is written to
+} BlockMove;
+
+typedef struct
+{
+    BlockMove *moves;
+    int moveCount;
+    int capacity;
+    int *componentStart;  // First move of each chain or cycle, whose moves have to run in order
+    int componentCount;
+    int componentCapacity;
+    int independentMoves; // Moves before this index belong to components that don't depend on each other
+    int blockCount;       // Number of file blocks laid out by the plan
+    int paths;            // Chains that end in a free block, each costs one move per block
+    int cycles;           // Closed cycles, each costs one extra move through a scratch block
+    int legacyMoves;      // Block writes the swap-based defragmentation would have done
+} MovePlan;
+
+// Returns the block at the given index, including the reserved scratch block.
+DiskBlock *blockAt(int index)
+{
+    return &disk[index];
+}
+
+unsigned char *blockData(int index)
+{
+    return blockPayloads + (size_t)index * BLOCK_SIZE;
+}
+
+uint32_t hashFileName(const char *fileName)
+{
+    uint32_t hash = 2166136261u;
+    for (const char *c = fileName; *c; c++)
+    {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
+
+void rebuildFileIndex();
+
+// Returns the ID of the file with the given name, or -1 if there isn't one.
+int findFileId(const char *fileName)
+{
+    if (fileIndex.capacity == 0)
+        rebuildFileIndex();
+
+    int mask = fileIndex.capacity - 1;
+    for (int slot = hashFileName(fileName) & mask; fileIndex.slots[slot] != -1; slot = (slot + 1) & mask)
+    {
+        if (strcmp(files[fileIndex.slots[slot]].fileName, fileName) == 0)
+        {
+            return fileIndex.slots[slot];
+        }
+    }
+    return -1;
+}
+
+void insertIntoFileIndex(int fileId);
+void openJournal(const char *imagePath, int existing);
+void closeJournal();
+
+void resizeFileIndex(int capacity)
+{
+    int *oldSlots = fileIndex.slots;
+    int oldCapacity = fileIndex.capacity;
+
+    fileIndex.slots = malloc(capacity * sizeof(int));
+    fileIndex.capacity = capacity;
+    fileIndex.count = 0;
+    for (int i = 0; i < capacity; i++)
+        fileIndex.slots[i] = -1;
+
+    for (int i = 0; i < oldCapacity; i++)
+    {
+        if (oldSlots[i] != -1)
+            insertIntoFileIndex(oldSlots[i]);
+    }
+    free(oldSlots);
+}
+
+void insertIntoFileIndex(int fileId)
+{
+    if (fileIndex.capacity == 0)
+        return; // Not built yet, the first lookup builds it from the file table
+
+    // Keep the load factor at or under a half so probes stay short
+    if ((fileIndex.count + 1) * 2 > fileIndex.capacity)
+        resizeFileIndex(fileIndex.capacity ? fileIndex.capacity * 2 : 64);
+
+    int mask = fileIndex.capacity - 1;
+    int slot = hashFileName(files[fileId].fileName) & mask;
+    while (fileIndex.slots[slot] != -1)
+        slot = (slot + 1) & mask;
+    fileIndex.slots[slot] = fileId;
+    fileIndex.count++;
+}
+
+// Removes a file from the index, shifting later entries of the probe run back so no tombstones are needed.
+void removeFromFileIndex(int fileId)
+{
+    if (fileIndex.capacity == 0)
+        return;
+
+    int mask = fileIndex.capacity - 1;
+    int slot = hashFileName(files[fileId].fileName) & mask;
+    while (fileIndex.slots[slot] != fileId)
+        slot = (slot + 1) & mask;
+
+    int next = (slot + 1) & mask;
+    while (fileIndex.slots[next] != -1)
+    {
+        int home = hashFileName(files[fileIndex.slots[next]].fileName) & mask;
+        // Move the entry into the hole unless its home lies cyclically in (slot, next]
+        if (((next - home) & mask) >= ((next - slot) & mask))
+        {
+            fileIndex.slots[slot] = fileIndex.slots[next];
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+    fileIndex.slots[slot] = -1;
+    fileIndex.count--;
+}
+
+void rebuildFileIndex()
+{
+    free(fileIndex.slots);
+    memset(&fileIndex, 0, sizeof(fileIndex));
+    fileIndex.slots = malloc(64 * sizeof(int));
+    fileIndex.capacity = 64;
+    for (int i = 0; i < fileIndex.capacity; i++)
+        fileIndex.slots[i] = -1;
+    for (int id = 0; id < diskHeader->fileSlotsUsed; id++)
+    {
+        if (files[id].used)
+            insertIntoFileIndex(id);
+    }
+}
+
+// Whether block b directly follows block a on disk. The scratch block sits past the end and follows nothing.
+int blocksAdjacent(int a, int b)
+{
+    return b == a + 1 && b < diskSize;
+}
+
+// Adds to a file's block and contiguous link counts and carries the change in its extents into the totals.
+void adjustFileLayout(int fileId, int blockDelta, int contiguousDelta)
+{
+    FileInfo *file = &files[fileId];
+    int extentsBefore = file->blockCount - file->contiguousLinks;
+    int blocksBefore = file->blockCount;
+
+    file->blockCount += blockDelta;
+    file->contiguousLinks += contiguousDelta;
+
+    int extentsAfter = file->blockCount - file->contiguousLinks;
+    metrics.totalExtents += extentsAfter - extentsBefore;
+    metrics.fileBlocks += blockDelta;
+    metrics.nonEmptyFiles += (file->blockCount > 0) - (blocksBefore > 0);
+    metrics.fragmentedFiles += (extentsAfter > 1) - (extentsBefore > 1);
+}
+
+// Sets a tree node from its two children, each covering half blocks.
+void combineFreeRuns(int node, int half)
+{
+    int left = node * 2, right = left + 1;
+    metrics.runPrefix[node] = metrics.runPrefix[left] == half ? half + metrics.runPrefix[right] : metrics.runPrefix[left];
+    metrics.runSuffix[node] = metrics.runSuffix[right] == half ? half + metrics.runSuffix[left] : metrics.runSuffix[right];
+    int longest = metrics.runSuffix[left] + metrics.runPrefix[right];
+    if (metrics.runLongest[left] > longest)
+        longest = metrics.runLongest[left];
+    if (metrics.runLongest[right] > longest)
+        longest = metrics.runLongest[right];
+    metrics.runLongest[node] = longest;
+}
+
+// Recomputes the free run tree from the leaves up to the root after a leaf changed.
+void updateFreeRunTree(int index, int isFree)
+{
+    int node = metrics.leaves + index;
+    metrics.runPrefix[node] = metrics.runSuffix[node] = metrics.runLongest[node] = isFree;
+
+    for (int half = 1; node > 1; half *= 2)
+    {
+        node /= 2;
+        combineFreeRuns(node, half);
+    }
+}
+
+// Updates the free space metrics for a block that just changed state. Blocks either side decide whether
+// a run was split, joined, started or ended. The scratch block isn't part of the disk and is ignored.
+void noteBlockState(int index, int isFree)
+{
+    if (index >= diskSize || metrics.leaves == 0)
+        return; // Not built yet, the build reads the block table as it is then
+
+    int freeNeighbours = (index > 0 && !disk[index - 1].occupied) + (index + 1 < diskSize && !disk[index + 1].occupied);
+    metrics.freeBlocks += isFree ? 1 : -1;
+    metrics.freeRuns += isFree ? 1 - freeNeighbours : freeNeighbours - 1;
+    updateFreeRunTree(index, isFree);
+}
+
+// Builds the free block counts and the free run tree from the block table, unless they are built already.
+void buildFreeSpaceMetrics()
+{
+    if (metrics.leaves != 0)
+        return;
+
+    metrics.leaves = 1;
+    while (metrics.leaves < diskSize)
+        metrics.leaves *= 2;
+    metrics.runPrefix = calloc(2 * metrics.leaves, sizeof(int));
+    metrics.runSuffix = calloc(2 * metrics.leaves, sizeof(int));
+    metrics.runLongest = calloc(2 * metrics.leaves, sizeof(int));
+    metrics.freeBlocks = 0;
+    metrics.freeRuns = 0;
+
+    // Leaves past the end of the disk stay at zero, as if occupied, so no run crosses the end
+    for (int i = 0; i < diskSize; i++)
+    {
+        int isFree = !disk[i].occupied;
+        int node = metrics.leaves + i;
+        metrics.runPrefix[node] = metrics.runSuffix[node] = metrics.runLongest[node] = isFree;
+        metrics.freeBlocks += isFree;
+        if (isFree && (i == 0 || disk[i - 1].occupied))
+            metrics.freeRuns++;
+    }
+    for (int half = 1; half < metrics.leaves; half *= 2)
+    {
+        for (int node = metrics.leaves / (half * 2); node < metrics.leaves / half; node++)
+        {
+            combineFreeRuns(node, half);
+        }
+    }
+}
+
+// Drops the free space side after the block table changed wholesale; the next reader builds it again.
+void discardFreeSpaceMetrics()
+{
+    free(metrics.runPrefix);
+    free(metrics.runSuffix);
+    free(metrics.runLongest);
+    metrics.runPrefix = metrics.runSuffix = metrics.runLongest = NULL;
+    metrics.leaves = 0;
+}
+
+// Sums the file totals. Unless countsSaved says the counts in the file table are known to be right, every
+// chain is walked to count them again.
+void rebuildFragmentationMetrics(int countsSaved)
+{
+    discardFreeSpaceMetrics();
+    memset(&metrics, 0, sizeof(metrics));
+
+    for (int i = 0; i < diskHeader->fileSlotsUsed; i++)
+    {
+        if (!files[i].used)
+            continue;
+
+        int blocks = files[i].blockCount, contiguous = files[i].contiguousLinks;
+        if (!countsSaved)
+        {
+            blocks = contiguous = 0;
+            for (int index = files[i].firstBlockIndex; index != -1; index = disk[index].nextBlockIndex)
+            {
+                blocks++;
+                if (disk[index].nextBlockIndex != -1 && blocksAdjacent(index, disk[index].nextBlockIndex))
+                    contiguous++;
+            }
+        }
+        files[i].blockCount = files[i].contiguousLinks = 0;
+        adjustFileLayout(i, blocks, contiguous);
+    }
+}
+
+int largestFreeRun()
+{
+    buildFreeSpaceMetrics();
+    return metrics.runLongest[1];
+}
+
+// Share of the files that are split into more than one extent.
+double fragmentedFileRatio()
+{
+    return diskHeader->fileCount ? (double)metrics.fragmentedFiles / diskHeader->fileCount : 0.0;
+}
+
+double averageExtentsPerFile()
+{
+    return diskHeader->fileCount ? (double)metrics.totalExtents / diskHeader->fileCount : 0.0;
+}
+
+// Share of the free blocks outside the largest free run: 0 when free space is one run.
+double freeSpaceFragmentation()
+{
+    buildFreeSpaceMetrics();
+    return metrics.freeBlocks ? 1.0 - (double)largestFreeRun() / metrics.freeBlocks : 0.0;
+}
+
+// Share of the links between consecutive file blocks that aren't to the next block on disk: 0 when every
+// file is contiguous, 1 when no two blocks of a file are adjacent.
+double fragmentationScore()
+{
+    long links = metrics.fileBlocks - metrics.nonEmptyFiles;
+    long breaks = metrics.totalExtents - metrics.nonEmptyFiles;
+    return links ? (double)breaks / links : 0.0;
+}
+
+// Whether a defrag is likely to pay for itself: files are split up, or free space is scattered.
+int defragWorthwhile(double threshold)
+{
+    return fragmentationScore() > threshold || freeSpaceFragmentation() > threshold;
+}
+
+void printFragmentationMetrics()
+{
+    buildFreeSpaceMetrics();
+    printf("\nFragmentation\n------\n");
+    printf("Fragmented files: %d of %d (%.1f%%), %.2f extents per file on average\n",
+           metrics.fragmentedFiles, diskHeader->fileCount, fragmentedFileRatio() * 100.0, averageExtentsPerFile());
+    printf("Free space: %d blocks in %d runs, largest run %d blocks, free space fragmentation %.1f%%\n",
+           metrics.freeBlocks, metrics.freeRuns, largestFreeRun(), freeSpaceFragmentation() * 100.0);
+    printf("Fragmentation score: %.3f\n", fragmentationScore());
+}
+
+void initializeDisk()
+{
+    for (int i = 0; i <= diskSize; i++)
+    {
+        disk[i].occupied = 0;
+        disk[i].nextBlockIndex = -1; // -1 indicates no next block
+        disk[i].prevBlockIndex = -1;
+        disk[i].fileId = -1;
+    }
+}
+
+void mapImageSections()
+{
+    diskRows = diskHeader->rows;
+    diskColumns = diskHeader->columns;
+    diskSize = diskRows * diskColumns;
+    disk = (DiskBlock *)((unsigned char *)diskHeader + diskHeader->blockTableOffset);
+    blockPayloads = (unsigned char *)diskHeader + diskHeader->payloadOffset;
+    files = (FileInfo *)((unsigned char *)diskHeader + diskHeader->fileTableOffset);
+}
+
+size_t alignToBlock(size_t offset)
+{
+    return (offset + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+// Whether an image's header describes a disk whose regions follow each other inside a file of fileSize bytes.
+int headerFitsImage(const DiskHeader *header, uint64_t fileSize)
+{
+    if (header->rows <= 0 || header->columns <= 0 || (int64_t)header->rows * header->columns >= INT32_MAX)
+        return 0;
+    if (header->fileCapacity <= 0 || header->fileSlotsUsed < 0 || header->fileSlotsUsed > header->fileCapacity ||
+        header->fileCount < 0 || header->fileCount > header->fileSlotsUsed || header->freeFileHead < -1 ||
+        header->freeFileHead >= header->fileSlotsUsed)
+        return 0;
+    // Bounding every offset by the file size first keeps the sums below from wrapping
+    if (header->imageSize > fileSize || header->blockTableOffset > fileSize || header->payloadOffset > fileSize ||
+        header->fileTableOffset > fileSize)
+        return 0;
+
+    uint64_t blocks = (uint64_t)header->rows * header->columns + 1; // The scratch block included
+    return header->blockTableOffset >= sizeof(DiskHeader) &&
+           header->payloadOffset >= header->blockTableOffset + blocks * sizeof(DiskBlock) &&
+           header->fileTableOffset >= header->payloadOffset + blocks * BLOCK_SIZE &&
+           header->imageSize >= header->fileTableOffset + (uint64_t)header->fileCapacity * sizeof(FileInfo);
+}
+
+// Opens the disk image at path, or creates an empty one with the given geometry if it doesn't exist.
+// With no path the disk is kept in anonymous memory. Returns 1 if an existing image was opened,
+// 0 if a new empty disk was created and -1 on error.
+int openDiskImage(const char *path, int rows, int columns)
+{
+    int existing = 0;
+    DiskHeader layout = {0};
+    layout.magic = DISK_MAGIC;
+    layout.version = DISK_VERSION;
+    layout.blockSize = BLOCK_SIZE;
+    layout.blockRecordSize = sizeof(DiskBlock);
+    layout.rows = rows;
+    layout.columns = columns;
+    layout.fileCapacity = FILE_COUNT;
+    layout.fileCount = 0;
+    layout.fileSlotsUsed = 0;
+    layout.freeFileHead = -1;
+    layout.blockTableOffset = alignToBlock(sizeof(DiskHeader));
+    layout.payloadOffset = alignToBlock(layout.blockTableOffset + ((size_t)rows * (size_t)columns + 1) * sizeof(DiskBlock));
+    layout.fileTableOffset = layout.payloadOffset + ((size_t)rows * (size_t)columns + 1) * BLOCK_SIZE;
+    layout.imageSize = alignToBlock(layout.fileTableOffset + (size_t)FILE_COUNT * sizeof(FileInfo));
+    // Only checked for a new disk, an existing image's header is checked against its file instead
+    int layoutFits = rows > 0 && columns > 0 && (int64_t)rows * columns < INT32_MAX &&
+                     (off_t)layout.imageSize > 0 && (uint64_t)(off_t)layout.imageSize == layout.imageSize;
+
+    if (path != NULL)
+    {
+        imageFd = open(path, O_RDWR | O_CREAT, 0644);
+        if (imageFd == -1)
+        {
+            perror("Failed to open disk image");
+            return -1;
+        }
+
+        struct stat st;
+        if (fstat(imageFd, &st) == -1)
+        {
+            perror("Failed to read disk image size");
+            close(imageFd);
+            imageFd = -1;
+            return -1;
+        }
+        if (st.st_size > 0)
+        {
+            DiskHeader existingHeader;
+            if (pread(imageFd, &existingHeader, sizeof(existingHeader), 0) != sizeof(existingHeader) ||
+                existingHeader.magic != DISK_MAGIC || existingHeader.version != DISK_VERSION ||
+                existingHeader.blockSize != BLOCK_SIZE || existingHeader.blockRecordSize != sizeof(DiskBlock) ||
+                !headerFitsImage(&existingHeader, st.st_size))
+            {
+                printf("%s is not a compatible disk image.\n", path);
+                close(imageFd);
+                imageFd = -1;
+                return -1;
+            }
+            layout = existingHeader;
+            existing = 1;
+        }
+        else if (!layoutFits)
+        {
+            printf("A %d x %d disk doesn't fit in an image file.\n", rows, columns);
+            close(imageFd);
+            imageFd = -1;
+            return -1;
+        }
+        else if (ftruncate(imageFd, layout.imageSize) == -1)
+        {
+            perror("Failed to size disk image");
+            close(imageFd);
+            imageFd = -1;
+            return -1;
+        }
+
+        diskHeader = mmap(NULL, layout.imageSize, PROT_READ | PROT_WRITE, MAP_SHARED, imageFd, 0);
+    }
+    else if (!layoutFits)
+    {
+        printf("A %d x %d disk doesn't fit in memory.\n", rows, columns);
+        return -1;
+    }
+    else
+    {
+        diskHeader = mmap(NULL, layout.imageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (diskHeader == MAP_FAILED)
+    {
+        perror("Failed to map disk image");
+        return -1;
+    }
+
+    if (!existing)
+    {
+        *diskHeader = layout;
+    }
+    mapImageSections();
+    if (!existing)
+    {
+        initializeDisk();
+    }
+    free(fileIndex.slots);
+    memset(&fileIndex, 0, sizeof(fileIndex));
+    rebuildFragmentationMetrics(existing && diskHeader->fileCountsSaved);
+
+    // The counts change from here on, a crash before the next clean close must not find them marked as saved
+    diskHeader->fileCountsSaved = 0;
+    if (imageFd != -1)
+        msync(diskHeader, sizeof(DiskHeader), MS_SYNC);
+    if (path != NULL && journalEnabled)
+    {
+        openJournal(path, existing);
+    }
+    return existing;
+}
+
+// Doubles the file table, which sits at the end of the image so only the mapping has to grow.
+// Returns 0 on success.
+int growFileTable()
+{
+    size_t oldSize = diskHeader->imageSize;
+    int capacity = diskHeader->fileCapacity * 2;
+    size_t newSize = alignToBlock(diskHeader->fileTableOffset + (size_t)capacity * sizeof(FileInfo));
+    DiskHeader *grown;
+
+    if (imageFd != -1)
+    {
+        if (ftruncate(imageFd, newSize) == -1)
+            return -1;
+        grown = mmap(NULL, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, imageFd, 0);
+        if (grown == MAP_FAILED)
+            return -1;
+    }
+    else
+    {
+        grown = mmap(NULL, newSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (grown == MAP_FAILED)
+            return -1;
+        memcpy(grown, diskHeader, oldSize);
+    }
+
+    munmap(diskHeader, oldSize);
+    diskHeader = grown;
+    diskHeader->fileCapacity = capacity;
+    diskHeader->imageSize = newSize;
+    mapImageSections();
+    return 0;
+}
+
+// Takes a file ID from the free list, or the next unused slot. Returns -1 if the table can't grow.
+int allocateFileId()
+{
+    int fileId = diskHeader->freeFileHead;
+    if (fileId != -1)
+    {
+        diskHeader->freeFileHead = files[fileId].nextFreeId;
+    }
+    else
+    {
+        if (diskHeader->fileSlotsUsed == diskHeader->fileCapacity && growFileTable() != 0)
+            return -1;
+        fileId = diskHeader->fileSlotsUsed++;
+    }
+
+    memset(&files[fileId], 0, sizeof(FileInfo));
+    files[fileId].used = 1;
+    files[fileId].firstBlockIndex = -1;
+    files[fileId].nextFreeId = -1;
+    diskHeader->fileCount++;
+    return fileId;
+}
+
+void releaseFileId(int fileId)
+{
+    files[fileId].used = 0;
+    files[fileId].nextFreeId = diskHeader->freeFileHead;
+    diskHeader->freeFileHead = fileId;
+    diskHeader->fileCount--;
+}
+
+void closeDiskImage()
+{
+    size_t size = diskHeader->imageSize;
+    closeJournal();
+    diskHeader->fileCountsSaved = 1;
+    if (imageFd != -1)
+    {
+        msync(diskHeader, size, MS_SYNC);
+        close(imageFd);
+        imageFd = -1;
+    }
+    munmap(diskHeader, size);
+    free(fileIndex.slots);
+    memset(&fileIndex, 0, sizeof(fileIndex));
+    free(metrics.runPrefix);
+    free(metrics.runSuffix);
+    free(metrics.runLongest);
+    memset(&metrics, 0, sizeof(metrics));
+}
+
+// Payloads carry a pattern derived from the owning file and the block's position in it,
+// so moved data can be checked after a defrag.
+uint32_t payloadSeed(const char *fileName, int blockNumber)
+{
+    uint32_t seed = 2166136261u;
+    for (const char *c = fileName; *c; c++)
+    {
+        seed = (seed ^ (unsigned char)*c) * 16777619u;
+    }
+    return seed ^ ((uint32_t)blockNumber * 2654435761u);
+}
+
+void fillPayload(int index, const char *fileName, int blockNumber)
+{
+    uint32_t *words = (uint32_t *)blockData(index);
+    uint32_t value = payloadSeed(fileName, blockNumber);
+    for (int i = 0; i < BLOCK_SIZE / 4; i++)
+    {
+        value = value * 1664525u + 1013904223u;
+        words[i] = value;
+    }
+}
+
+// Checks every file block still holds the payload it was written with. Returns the number of bad blocks.
+int verifyPayloads()
+{
+    int badBlocks = 0;
+    for (int i = 0; i < diskHeader->fileSlotsUsed; i++)
+    {
+        if (!files[i].used)
+            continue;
+
+        int blockNumber = 0;
+        int currentBlockIndex = files[i].firstBlockIndex;
+        while (currentBlockIndex != -1)
+        {
+            uint32_t *words = (uint32_t *)blockData(currentBlockIndex);
+            uint32_t value = payloadSeed(files[i].fileName, blockNumber);
+            for (int w = 0; w < BLOCK_SIZE / 4; w++)
+            {
+                value = value * 1664525u + 1013904223u;
+                if (words[w] != value)
+                {
+                    badBlocks++;
+                    break;
+                }
+            }
+            currentBlockIndex = blockAt(currentBlockIndex)->nextBlockIndex;
+            blockNumber++;
+        }
+    }
+    return badBlocks;
+}
+
+// Returns the lowest unoccupied block, found by walking the free run tree down from the root towards the
+// leftmost subtree with any free block in it, or -1 if the disk is full.
+int findFirstEmptyBlock()
+{
+    buildFreeSpaceMetrics();
+    if (metrics.runLongest[1] == 0)
+        return -1;
+
+    int node = 1;
+    while (node < metrics.leaves)
+    {
+        node *= 2;
+        if (metrics.runLongest[node] == 0)
+            node++;
+    }
+    return node - metrics.leaves;
+}
+
+int selectRandomUnoccupiedBlock()
+{
+    int blockIndex = rand() % diskSize;
+    while (disk[blockIndex].occupied)
+    {
+        blockIndex = rand() % diskSize;
+    }
+    return blockIndex;
+}
+
+// Frees a file's blocks and its ID. The caller holds diskLock.
+void removeFile(int fileId)
+{
+    adjustFileLayout(fileId, -files[fileId].blockCount, -files[fileId].contiguousLinks);
+
+    // Unoccupy the blocks
+    int nextIndex = files[fileId].firstBlockIndex;
+    while (nextIndex != -1)
+    {
+        DiskBlock *db = blockAt(nextIndex);
+        int index = nextIndex;
+        nextIndex = db->nextBlockIndex;
+        db->occupied = 0;
+        db->nextBlockIndex = -1;
+        db->prevBlockIndex = -1;
+        db->fileId = -1;
+        noteBlockState(index, 1);
+    }
+
+    removeFromFileIndex(fileId);
+    releaseFileId(fileId);
+    diskVersion++;
+}
+
+// Creates a file of blockCount blocks in the first free blocks. The caller holds diskLock.
+// Returns the new file's ID, -1 if the file table can't grow, -2 if the disk is full (nothing is kept in that
+// case) and -3 if the name is taken.
+int createFile(const char *fileName, const char *creationDate, int blockCount)
+{
+    if (findFileId(fileName) != -1)
+    {
+        return -3;
+    }
+    int fileId = allocateFileId();
+    if (fileId == -1)
+    {
+        return -1;
+    }
+    diskVersion++;
+
+    FileInfo *newFile = &files[fileId];
+    strncpy(newFile->fileName, fileName, sizeof(newFile->fileName) - 1);
+    strncpy(newFile->creationDate, creationDate, sizeof(newFile->creationDate) - 1);
+
+    // Create blocks
+    int previousBlockIndex = -1;
+    for (int i = 0; i < blockCount; i++)
+    {
+        int targetIndex = findFirstEmptyBlock();
+        if (targetIndex == -1)
+        {
+            // Give back the blocks taken so far
+            adjustFileLayout(fileId, -newFile->blockCount, -newFile->contiguousLinks);
+            while (previousBlockIndex != -1)
+            {
+                DiskBlock *db = blockAt(previousBlockIndex);
+                int index = previousBlockIndex;
+                previousBlockIndex = db->prevBlockIndex;
+                db->occupied = 0;
+                db->nextBlockIndex = -1;
+                db->prevBlockIndex = -1;
+                db->fileId = -1;
+                noteBlockState(index, 1);
+            }
+            releaseFileId(fileId);
+            return -2;
+        }
+
+        // Init new block
+        DiskBlock newBlock;
+        newBlock.fileId = fileId;
+        newBlock.occupied = 1;
+        newBlock.nextBlockIndex = -1;
+        newBlock.prevBlockIndex = previousBlockIndex;
+        disk[targetIndex] = newBlock;
+        fillPayload(targetIndex, newFile->fileName, i);
+        noteBlockState(targetIndex, 0);
+        adjustFileLayout(fileId, 1, previousBlockIndex != -1 && blocksAdjacent(previousBlockIndex, targetIndex));
+
+        // If this is not the first block of the file, link previous block to this
+        if (previousBlockIndex != -1)
+        {
+            disk[previousBlockIndex].nextBlockIndex = targetIndex;
+        }
+
+        // Update firstBlockIndex in file info if this is the first block
+        else
+        {
+            newFile->firstBlockIndex = targetIndex;
+        }
+
+        previousBlockIndex = targetIndex;
+    }
+    insertIntoFileIndex(fileId);
+    return fileId;
+}
+
+void deleteFile()
+{
+    printf("\n\nFiles\n------\n");
+    pthread_mutex_lock(&diskLock);
+    for (int i = 0; i < diskHeader->fileSlotsUsed; i++)
+    {
+        if (files[i].used)
+            printf("%d: %s\n", i, files[i].fileName);
+    }
+    pthread_mutex_unlock(&diskLock);
+    printf("-1: None\n");
+
+    int fileToDelete;
+    printf("\nEnter the ID of the file to delete, or -1 to keep all files: ");
+    scanf("%d", &fileToDelete);
+    getchar(); // consume newline left in the buffer.
+
+    if (fileToDelete == -1)
+    {
+        printf("No files were deleted.\n");
+        return;
+    }
+
+    pthread_mutex_lock(&diskLock);
+    int valid = fileToDelete >= 0 && fileToDelete < diskHeader->fileSlotsUsed && files[fileToDelete].used;
+    if (valid)
+    {
+        removeFile(fileToDelete);
+    }
+    pthread_mutex_unlock(&diskLock);
+
+    if (valid)
+        printf("File deleted successfully.\n");
+    else
+        printf("Invalid input, no files were deleted.\n");
+}
+
+void addNewFile()
+{
+    char newFileName[20]; // File Name
+    int blockCount;       // Number of blocks
+
+    getchar(); // Clear the input buffer
+
+    printf("\nEnter the file name: ");
+    fgets(newFileName, sizeof(newFileName), stdin); // input file name
+    newFileName[strcspn(newFileName, "\n")] = 0;    // remove newline from fgets
+
+    // Get the current date
+    time_t t = time(NULL);
+    struct tm *tm = localtime(&t);
+    char newCreationDate[20];
+    strftime(newCreationDate, sizeof(newCreationDate), "%Y-%m-%d", tm);
+
+    printf("\nEnter the number of blocks: ");
+    scanf("%d", &blockCount); // input number of blocks
+    getchar();                // To remove the newline left in the input buffer.
+
+    pthread_mutex_lock(&diskLock);
+    int result = createFile(newFileName, newCreationDate, blockCount);
+    pthread_mutex_unlock(&diskLock);
+
+    if (result == -1)
+    {
+        printf("File table could not grow. Cannot add more files.\n");
+        return;
+    }
+    if (result == -2)
+    {
+        printf("Disk is full. Cannot add more files.\n");
+        return;
+    }
+    if (result == -3)
+    {
+        printf("A file with that name already exists.\n");
+        return;
+    }
+    printf("\nFile added successfully.\n");
+}
+
+void createFiles()
+{
+    srand(time(NULL)); // Seed for random number generation
+    int freeBlocks = diskSize;
+    for (int n = 0; n < FILE_COUNT; n++)
+    {
+        // Stop early on disks too small for every starter file
+        if (freeBlocks < 2)
+        {
+            break;
+        }
+
+        // Generate file details
+        int i = allocateFileId();
+        sprintf(files[i].fileName, "File%d", n + 1);
+
+        // Generate random creation date
+        time_t t = time(NULL);
+        struct tm *tm = localtime(&t);
+        int year = rand() % 25 + 2000; // Random year between 2000 and 2020
+        int month = rand() % 12 + 1;   // Random month between 1 and 12
+        int day = rand() % 28 + 1;     // Random day between 1 and 28
+        tm->tm_year = year - 1900;     // Adjust year
+        tm->tm_mon = month - 1;        // Adjust month
+        tm->tm_mday = day;             // Adjust day
+        strftime(files[i].creationDate, sizeof(files[i].creationDate), "%Y-%m-%d", tm);
+
+        files[i].firstBlockIndex = -1; // Initialize to -1
+
+        int blockCount = rand() % 4 + 2; // Random block length from 2 to 5
+        if (blockCount > freeBlocks)
+            blockCount = freeBlocks;
+        freeBlocks -= blockCount;
+        int prevBlockIndex = -1;
+
+        for (int b = 0; b < blockCount; b++)
+        {
+            int blockIndex = selectRandomUnoccupiedBlock();
+
+            disk[blockIndex].occupied = 1;
+            disk[blockIndex].fileId = i;
+            fillPayload(blockIndex, files[i].fileName, b);
+            noteBlockState(blockIndex, 0);
+            adjustFileLayout(i, 1, prevBlockIndex != -1 && blocksAdjacent(prevBlockIndex, blockIndex));
+
+            // Will update if another block follows
+            disk[blockIndex].nextBlockIndex = -1;
+            disk[blockIndex].prevBlockIndex = prevBlockIndex;
+
+            // Link from the previous block if not the first block
+            if (prevBlockIndex != -1)
+            {
+                disk[prevBlockIndex].nextBlockIndex = blockIndex;
+            }
+            else
+            {
+                // Set first block for the file
+                files[i].firstBlockIndex = blockIndex;
+            }
+
+            prevBlockIndex = blockIndex;
+        }
+        insertIntoFileIndex(i);
+    }
+}
+
+void displayFiles()
+{
+    printf("\nFiles\n------");
+    for (int i = 0; i < diskHeader->fileSlotsUsed; i++)
+    {
+        if (!files[i].used)
+            continue;
+
+        printf("\nID: %d, Name: %s, Creation Date: %s, First Block Index: %d\n",
+               i, files[i].fileName, files[i].creationDate, files[i].firstBlockIndex);
+
+        int nextIndex = files[i].firstBlockIndex;
+        int fileSize = 0;
+
+        while (nextIndex != -1)
+        {
+            DiskBlock *block = &disk[nextIndex];
+            printf("    Block at [%d,%d], Next Block Index: %d\n",
+                   nextIndex / diskColumns, nextIndex % diskColumns, block->nextBlockIndex);
+            nextIndex = block->nextBlockIndex;
+            fileSize++;
+        }
+
+        printf("File Size: %d blocks, %d extents\n", fileSize, files[i].blockCount - files[i].contiguousLinks);
+    }
+    printFragmentationMetrics();
+}
+
+double secondsSince(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Disk map renderer
+// ------
+// Each frame is built in one buffer and sent with a single write. The renderer remembers what every cell
+// showed last, so an update frame only moves the cursor to the cells that changed and redraws those.
+// Updates come at most once per FRAME_INTERVAL_MS, changes in between are picked up by the next one.
+// A disk that fits the terminal shows one file name per block; a bigger one is downsampled to a heat map
+// where each cell covers a rectangle of blocks and shows how full it is. While an animation runs, anything
+// else to say goes through renderStatus(), which keeps one status line under the map.
+
+#define FRAME_FULL 0        // Draw the whole map below the cursor
+#define FRAME_CHANGES 1     // Redraw the cells that changed, unless the last frame was too recent
+#define FRAME_CHANGES_NOW 2 // Redraw the cells that changed regardless of the frame rate cap
+#define FRAME_INTERVAL_MS 33
+#define NAME_CELL_WIDTH 8
+#define HEAT_LEVELS " .:-=+*#%@"
+
+typedef struct
+{
+    int cellRows, cellColumns;   // Size of the map in cells
+    int blockRows, blockColumns; // Blocks covered by one cell, 1x1 shows file names
+    int cellWidth;               // Characters per cell
+    int frameLines;              // Lines of the last full frame, the cursor sits just below them
+    int *shown;                  // What each cell showed in the last frame
+    char *buffer;
+    size_t length, capacity;
+    struct timespec lastFrame;
+    int onScreen;  // Whether a full frame has been drawn that updates can patch
+    int animating; // Whether the frame is the last thing on the terminal, so output must go through it
+    int hasStatus; // Whether the frame ends with a status line
+} DiskRenderer;
+
+DiskRenderer renderer;
+
+void appendFrame(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int needed = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (renderer.length + needed + 1 > renderer.capacity)
+    {
+        while (renderer.length + needed + 1 > renderer.capacity)
+            renderer.capacity = renderer.capacity ? renderer.capacity * 2 : 4096;
+        renderer.buffer = realloc(renderer.buffer, renderer.capacity);
+    }
+
+    va_start(args, format);
+    vsnprintf(renderer.buffer + renderer.length, needed + 1, format, args);
+    va_end(args);
+    renderer.length += needed;
+}
+
+// Sends the frame with one write, looping only if the terminal takes it in pieces.
+void flushFrame()
+{
+    fflush(stdout); // Anything printed before must land above the frame
+    size_t written = 0;
+    while (written < renderer.length)
+    {
+        ssize_t result = write(STDOUT_FILENO, renderer.buffer + written, renderer.length - written);
+        if (result <= 0)
+            break;
+        written += result;
+    }
+    renderer.length = 0;
+    clock_gettime(CLOCK_MONOTONIC, &renderer.lastFrame);
+}
+
+// Picks name cells or a heat map from the terminal size, falling back to 80x24 when it isn't a terminal.
+void layoutRenderer()
+{
+    struct winsize size;
+    int width = 80, height = 24;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 && size.ws_row > 0)
+    {
+        width = size.ws_col;
+        height = size.ws_row;
+    }
+    height -= 4; // Room for the legend and the prompt under the map
+    if (height < 1)
+        height = 1;
+    if (width < 2) // The heat map leaves the last column free, so it needs two
+        width = 2;
+
+    if (diskColumns * NAME_CELL_WIDTH <= width && diskRows <= height)
+    {
+        renderer.blockRows = renderer.blockColumns = 1;
+        renderer.cellWidth = NAME_CELL_WIDTH;
+    }
+    else
+    {
+        renderer.blockColumns = (diskColumns + width - 2) / (width - 1);
+        renderer.blockRows = (diskRows + height - 1) / height;
+        renderer.cellWidth = 1;
+    }
+    renderer.cellRows = (diskRows + renderer.blockRows - 1) / renderer.blockRows;
+    renderer.cellColumns = (diskColumns + renderer.blockColumns - 1) / renderer.blockColumns;
+
+    free(renderer.shown);
+    renderer.shown = malloc((size_t)renderer.cellRows * renderer.cellColumns * sizeof(int));
+}
+
+int heatMap()
+{
+    return renderer.blockRows > 1 || renderer.blockColumns > 1;
+}
+
+// What a cell shows: the file ID of its block (-1 when free) on the name map, the heat level on a heat map.
+int cellValue(int cellRow, int cellColumn)
+{
+    if (!heatMap())
+    {
+        DiskBlock *block = &disk[cellRow * diskColumns + cellColumn];
+        return block->occupied ? block->fileId : -1;
+    }
+
+    int occupied = 0, blocks = 0;
+    for (int r = cellRow * renderer.blockRows; r < (cellRow + 1) * renderer.blockRows && r < diskRows; r++)
+    {
+        for (int c = cellColumn * renderer.blockColumns; c < (cellColumn + 1) * renderer.blockColumns && c < diskColumns; c++)
+        {
+            occupied += disk[r * diskColumns + c].occupied;
+            blocks++;
+        }
+    }
+    // Round up so a cell with any file block in it never looks empty
+    return (occupied * (int)(sizeof(HEAT_LEVELS) - 2) + blocks - 1) / blocks;
+}
+
+void appendCell(int value)
+{
+    if (heatMap())
+        appendFrame("%c", HEAT_LEVELS[value]);
+    else
+        appendFrame("%-*.*s", renderer.cellWidth, renderer.cellWidth - 1, value == -1 ? "x" : files[value].fileName);
+}
+
+void drawFullFrame()
+{
+    layoutRenderer();
+    for (int r = 0; r < renderer.cellRows; r++)
+    {
+        for (int c = 0; c < renderer.cellColumns; c++)
+        {
+            int value = cellValue(r, c);
+            renderer.shown[r * renderer.cellColumns + c] = value;
+            appendCell(value);
+        }
+        appendFrame("\n");
+    }
+    renderer.frameLines = renderer.cellRows;
+    renderer.hasStatus = 0;
+    if (heatMap())
+    {
+        appendFrame("Heat map, each cell is %dx%d blocks: '%c' empty to '%c' full\n", renderer.blockRows,
+                    renderer.blockColumns, HEAT_LEVELS[0], HEAT_LEVELS[sizeof(HEAT_LEVELS) - 2]);
+        renderer.frameLines++;
+    }
+    renderer.onScreen = 1;
+    flushFrame();
+}
+
+// Moves the cursor from below the frame to each changed cell, redraws it and returns below the frame.
+void drawChangedCells()
+{
+    int cursorLine = renderer.frameLines;
+    for (int r = 0; r < renderer.cellRows; r++)
+    {
+        for (int c = 0; c < renderer.cellColumns; c++)
+        {
+            int value = cellValue(r, c);
+            int *shown = &renderer.shown[r * renderer.cellColumns + c];
+            if (value == *shown)
+                continue;
+
+            if (cursorLine != r)
+                appendFrame("\033[%d%c", abs(cursorLine - r), cursorLine > r ? 'A' : 'B');
+            appendFrame("\r");
+            if (c > 0)
+                appendFrame("\033[%dC", c * renderer.cellWidth);
+            appendCell(value);
+            *shown = value;
+            cursorLine = r;
+        }
+    }
+    if (renderer.length == 0)
+        return;
+
+    appendFrame("\033[%dB\r", renderer.frameLines - cursorLine);
+    flushFrame();
+}
+
+void displayDisk(int frame)
+{
+    if (frame == FRAME_FULL || !renderer.onScreen)
+    {
+        drawFullFrame();
+        return;
+    }
+    if (frame == FRAME_CHANGES && secondsSince(&renderer.lastFrame) * 1000.0 < FRAME_INTERVAL_MS)
+        return;
+    drawChangedCells();
+}
+
+// Prints a line of text. During an animation it replaces the status line under the map instead, as text
+// printed below the frame would leave the cursor where the next update doesn't expect it.
+void renderStatus(const char *format, ...)
+{
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    if (!renderer.animating)
+    {
+        printf("%s\n", message);
+        return;
+    }
+    if (renderer.hasStatus)
+        appendFrame("\033[1A\r\033[K");
+    else
+        renderer.frameLines++;
+    appendFrame("%s\n", message);
+    renderer.hasStatus = 1;
+    flushFrame();
+}
+
+// Shows a move that was just made. On the name map the animation pauses moveDelayMs after every move so
+// each block can be followed; moves into the scratch block aren't visible and a heat map is too coarse,
+// so those only update at the frame rate.
+void animateMove(int to)
+{
+    if (moveDelayMs > 0 && !heatMap() && to != SCRATCH_BLOCK)
+    {
+        displayDisk(FRAME_CHANGES_NOW);
+        usleep(moveDelayMs * 1000);
+    }
+    else
+    {
+        displayDisk(FRAME_CHANGES);
+    }
+}
+
+// Moves a block's table entry to an unoccupied index and re-links its neighbours, so the chain stays valid
+// after every move. The payload is moved separately.
+void moveBlockRecord(int from, int to)
+{
+    DiskBlock *source = blockAt(from);
+    DiskBlock *target = blockAt(to);
+    *target = *source;
+    noteBlockState(to, 0);
+
+    int prev = target->prevBlockIndex, next = target->nextBlockIndex;
+    int contiguousBefore = (prev != -1 && blocksAdjacent(prev, from)) + (next != -1 && blocksAdjacent(from, next));
+    int contiguousAfter = (prev != -1 && blocksAdjacent(prev, to)) + (next != -1 && blocksAdjacent(to, next));
+    adjustFileLayout(target->fileId, 0, contiguousAfter - contiguousBefore);
+
+    if (prev != -1)
+        blockAt(prev)->nextBlockIndex = to;
+    else
+        files[target->fileId].firstBlockIndex = to;
+
+    if (next != -1)
+        blockAt(next)->prevBlockIndex = to;
+
+    source->occupied = 0;
+    source->nextBlockIndex = -1;
+    source->prevBlockIndex = -1;
+    source->fileId = -1;
+    noteBlockState(from, 1);
+}
+
+void moveBlock(int from, int to)
+{
+    memcpy(blockData(to), blockData(from), BLOCK_SIZE);
+    moveBlockRecord(from, to);
+}
+
+void addMove(MovePlan *plan, int from, int to)
+{
+    if (plan->moveCount == plan->capacity)
+    {
+        plan->capacity = plan->capacity ? plan->capacity * 2 : 64;
+        plan->moves = realloc(plan->moves, plan->capacity * sizeof(BlockMove));
+    }
+    plan->moves[plan->moveCount].from = from;
+    plan->moves[plan->moveCount].to = to;
+    plan->moveCount++;
+}
+
+void startComponent(MovePlan *plan)
+{
+    if (plan->componentCount == plan->componentCapacity)
+    {
+        plan->componentCapacity = plan->componentCapacity ? plan->componentCapacity * 2 : 16;
+        plan->componentStart = realloc(plan->componentStart, plan->componentCapacity * sizeof(int));
+    }
+    plan->componentStart[plan->componentCount++] = plan->moveCount;
+}
+
+void freeMovePlan(MovePlan *plan)
+{
+    free(plan->moves);
+    free(plan->componentStart);
+    memset(plan, 0, sizeof(*plan));
+}
+
+// Fills target[] with the final index of every block (files laid out back to back, in order), -1 for free blocks.
+// The scratch block is included, a block left there by an unfinished run is moved out like any other.
+// Works on the given tables, the live ones or a copy of them. Returns the number of file blocks.
+int computeTargetLayout(int *target, const DiskBlock *blocks, const FileInfo *fileTable, int fileSlots)
+{
+    int writePos = 0;
+    for (int i = 0; i <= diskSize; i++)
+    {
+        target[i] = -1;
+    }
+    for (int i = 0; i < fileSlots; i++)
+    {
+        int currentBlockIndex = fileTable[i].used ? fileTable[i].firstBlockIndex : -1;
+        while (currentBlockIndex != -1)
+        {
+            target[currentBlockIndex] = writePos++;
+            currentBlockIndex = blocks[currentBlockIndex].nextBlockIndex;
+        }
+    }
+    return writePos;
+}
+
+// Counts the block writes the old swap-based defragmentation does for the same layout: it walks the final
+// positions in order and swaps the wanted block in whenever it isn't already there, two writes per swap.
+int countSwapDefragMoves(const int *target, int blockCount)
+{
+    int *occupant = malloc((diskSize + 1) * sizeof(int)); // final index of the block currently at each index, -1 if free
+    int *whereIs = malloc(diskSize * sizeof(int));        // current index of the block bound for each final index
+    int swaps = 0;
+
+    for (int i = 0; i <= diskSize; i++)
+    {
+        occupant[i] = target[i];
+        if (target[i] != -1)
+            whereIs[target[i]] = i;
+    }
+
+    for (int writePos = 0; writePos < blockCount; writePos++)
+    {
+        int currentBlockIndex = whereIs[writePos];
+        if (currentBlockIndex != writePos)
+        {
+            int displaced = occupant[writePos];
+            occupant[writePos] = writePos;
+            occupant[currentBlockIndex] = displaced;
+            if (displaced != -1)
+                whereIs[displaced] = currentBlockIndex;
+            whereIs[writePos] = writePos;
+            swaps++;
+        }
+    }
+    free(occupant);
+    free(whereIs);
+    return swaps * 2;
+}
+
+// Plans the defragmentation as a list of single block moves. The target layout is a permutation of the
+// occupied blocks; chains of it that end in a free block are moved back to front with one move per block,
+// and closed cycles are broken by parking one block in a free block (or the reserved scratch block when
+// the disk is full) for one extra move.
+void addCycle(MovePlan *plan, const int *source, int *done, int index, int scratch)
+{
+    // Park the block bound for index, then walk the cycle backwards from the block it came from.
+    int parked = source[index];
+    startComponent(plan);
+    addMove(plan, parked, scratch);
+    done[parked] = 1;
+
+    int emptyIndex = parked;
+    while (source[emptyIndex] != parked)
+    {
+        int from = source[emptyIndex];
+        addMove(plan, from, emptyIndex);
+        done[from] = 1;
+        emptyIndex = from;
+    }
+    addMove(plan, scratch, emptyIndex);
+    plan->cycles++;
+}
+
+// Plans the moves that turn the current layout into target[]. Only reads target[], so it can run without
+// the disk lock on a layout taken from a copy of the tables.
+void planMovesToLayout(MovePlan *plan, const int *target, int blockCount)
+{
+    int *source = malloc((diskSize + 1) * sizeof(int)); // which index holds the block bound for each index, -1 if none
+    int *done = malloc((diskSize + 1) * sizeof(int));
+
+    memset(plan, 0, sizeof(*plan));
+    plan->blockCount = blockCount;
+    plan->legacyMoves = countSwapDefragMoves(target, plan->blockCount);
+
+    for (int i = 0; i <= diskSize; i++)
+    {
+        source[i] = -1;
+        done[i] = 0;
+    }
+    for (int i = 0; i <= diskSize; i++)
+    {
+        if (target[i] != -1)
+            source[target[i]] = i;
+        if (target[i] == i)
+            done[i] = 1; // already in place
+    }
+
+    // Chains ending in a free block: fill the free block first, then the block that was just emptied.
+    for (int i = 0; i <= diskSize; i++)
+    {
+        if (target[i] != -1 || source[i] == -1)
+            continue;
+
+        int emptyIndex = i;
+        startComponent(plan);
+        while (source[emptyIndex] != -1)
+        {
+            int from = source[emptyIndex];
+            addMove(plan, from, emptyIndex);
+            done[from] = 1;
+            emptyIndex = from;
+        }
+        plan->paths++;
+    }
+
+    // Whatever is left forms closed cycles. A block that is free before and after the defrag makes a scratch
+    // block no other move touches, so each cycle gets one of its own while they last. The remaining cycles
+    // share a block that is free once the chains are done (or the reserved one) and run after everything else.
+    int nextScratch = 0;
+    int sharedScratch = SCRATCH_BLOCK;
+    int deferredCount = 0;
+    int *deferred = malloc((diskSize + 1) * sizeof(int)); // first index of each cycle left for the shared block
+
+    for (int i = 0; i < diskSize; i++)
+    {
+        if (source[i] == -1 && sharedScratch == SCRATCH_BLOCK)
+            sharedScratch = i;
+    }
+
+    for (int i = 0; i < diskSize; i++)
+    {
+        if (target[i] == -1 || done[i])
+            continue;
+
+        while (nextScratch < diskSize && (target[nextScratch] != -1 || source[nextScratch] != -1))
+            nextScratch++;
+
+        if (nextScratch < diskSize)
+        {
+            addCycle(plan, source, done, i, nextScratch++);
+        }
+        else
+        {
+            // Mark the whole cycle so it is only deferred once
+            deferred[deferredCount++] = i;
+            int index = i;
+            do
+            {
+                done[index] = 1;
+                index = target[index];
+            } while (index != i);
+        }
+    }
+
+    plan->independentMoves = plan->moveCount;
+    for (int c = 0; c < deferredCount; c++)
+    {
+        int index = deferred[c];
+        do
+        {
+            done[index] = 0;
+            index = target[index];
+        } while (index != deferred[c]);
+        addCycle(plan, source, done, deferred[c], sharedScratch);
+    }
+
+    free(deferred);
+    free(source);
+    free(done);
+}
+
+void planDefragmentation(MovePlan *plan)
+{
+    int *target = malloc((diskSize + 1) * sizeof(int));
+    int blockCount = computeTargetLayout(target, disk, files, diskHeader->fileSlotsUsed);
+    planMovesToLayout(plan, target, blockCount);
+    free(target);
+}
+
+void printPlanSummary(const MovePlan *plan)
+{
+    long planBytes = (long)plan->moveCount * BLOCK_SIZE;
+    long legacyBytes = (long)plan->legacyMoves * BLOCK_SIZE;
+
+    printf("\nDefrag plan\n------\n");
+    printf("File blocks: %d, chains: %d, cycles: %d\n", plan->blockCount, plan->paths, plan->cycles);
+    printf("Planned moves: %d (%ld KiB)\n", plan->moveCount, planBytes / 1024);
+    printf("Swap-based moves: %d (%ld KiB)\n", plan->legacyMoves, legacyBytes / 1024);
+    if (plan->legacyMoves > 0)
+    {
+        printf("Saved: %.1f%% of block writes\n", 100.0 * (plan->legacyMoves - plan->moveCount) / plan->legacyMoves);
+    }
+}
+
+void applyPlanJournaled(const MovePlan *plan);
+void printJournalStats(const JournalStats *stats);
+
+// Runs a plan one move at a time, animating the disk when rendering is on. Image files are journaled.
+void applyPlan(const MovePlan *plan)
+{
+    if (renderEnabled)
+    {
+        displayDisk(FRAME_FULL);
+        renderer.animating = 1;
+    }
+
+    if (journal.fd != -1)
+    {
+        applyPlanJournaled(plan);
+    }
+    else
+    {
+        for (int i = 0; i < plan->moveCount; i++)
+        {
+            moveBlock(plan->moves[i].from, plan->moves[i].to);
+            if (renderEnabled)
+                animateMove(plan->moves[i].to);
+        }
+    }
+
+    if (renderEnabled)
+    {
+        displayDisk(FRAME_CHANGES_NOW);
+        renderer.animating = 0;
+    }
+}
+
+void defragment()
+{
+    MovePlan plan;
+    pthread_mutex_lock(&diskLock);
+    diskVersion++;
+    planDefragmentation(&plan);
+
+    applyPlan(&plan);
+
+    printPlanSummary(&plan);
+    if (journal.fd != -1)
+        printJournalStats(&journal.run);
+    freeMovePlan(&plan);
+
+    int badBlocks = verifyPayloads();
+    pthread_mutex_unlock(&diskLock);
+    if (badBlocks == 0)
+        printf("Block data verified.\n");
+    else
+        printf("Block data check failed: %d corrupt block(s).\n", badBlocks);
+}
+
+// Finishes the defrag an earlier run was killed in. Opening the image has already rolled it forward to the
+// last journaled group; this plans the rest from there. Every path that opens an image calls it first.
+void resumeInterruptedDefrag()
+{
+    if (!journal.interrupted)
+        return;
+
+    printf("\nResuming the interrupted defrag...\n\n");
+    journal.interrupted = 0;
+    defragment();
+    printf("\nDisk defragmented.\n");
+}
+
+// Batched block I/O engine
+// ------
+// Moves payloads of a file-backed image with positioned reads and writes instead of copying through the
+// mapping one block at a time. The plan is split into waves: a move lands in the wave after every move it
+// depends on (the one that last read its target, or last wrote its source or target), so the moves of one
+// wave never touch each other's blocks and can all be in flight at once. Moves in a wave that are adjacent
+// on both sides are merged into one larger sequential transfer.
+
+#define MAX_TRANSFER_BLOCKS 256 // 1 MiB per transfer
+#define MAX_IO_WORKERS 16
+#define DEFAULT_QUEUE_DEPTH 32
+
+int ioQueueDepth = DEFAULT_QUEUE_DEPTH; // Transfers the batched engine keeps in flight, --queue-depth
+
+typedef struct
+{
+    int from;  // First block read
+    int to;    // First block written
+    int count; // Number of consecutive blocks
+} BlockTransfer;
+
+typedef struct
+{
+    const char *backend;
+    int waves;
+    int wavesDone; // All of them unless the run failed
+    int transfers;
+    int moves;
+    int maxQueueDepth;
+    double queueDepthSum; // summed at every submission, for the average
+    long queueDepthSamples;
+    double seconds;
+} EngineStats;
+
+off_t payloadOffset(int index)
+{
+    return (off_t)diskHeader->payloadOffset + (off_t)index * BLOCK_SIZE;
+}
+
+// Copies one transfer with blocking positioned I/O. Returns 0 on success.
+int copyTransfer(const BlockTransfer *transfer, unsigned char *buffer)
+{
+    size_t bytes = (size_t)transfer->count * BLOCK_SIZE;
+    if (pread(imageFd, buffer, bytes, payloadOffset(transfer->from)) != (ssize_t)bytes)
+        return -1;
+    if (pwrite(imageFd, buffer, bytes, payloadOffset(transfer->to)) != (ssize_t)bytes)
+        return -1;
+    return 0;
+}
+
+int compareMoveSource(const void *a, const void *b)
+{
+    return ((const BlockMove *)a)->from - ((const BlockMove *)b)->from;
+}
+
+// Groups the plan into waves and merges adjacent moves. Returns the transfers ordered by wave, with
+// waveStart[w] the index of the first transfer of wave w (waveStart[waveCount] is the total).
+BlockTransfer *buildTransfers(const MovePlan *plan, int **waveStart, int *waveCount)
+{
+    int slots = diskSize + 1; // include the scratch block
+    int *lastRead = malloc(slots * sizeof(int));
+    int *lastWrite = malloc(slots * sizeof(int));
+    int *moveWave = malloc((plan->moveCount + 1) * sizeof(int));
+    int waves = 0;
+
+    for (int i = 0; i < slots; i++)
+    {
+        lastRead[i] = -1;
+        lastWrite[i] = -1;
+    }
+
+    for (int i = 0; i < plan->moveCount; i++)
+    {
+        const BlockMove *move = &plan->moves[i];
+        int wave = lastRead[move->to];
+        if (lastWrite[move->to] > wave)
+            wave = lastWrite[move->to];
+        if (lastWrite[move->from] > wave)
+            wave = lastWrite[move->from];
+        wave++;
+
+        moveWave[i] = wave;
+        if (wave > lastRead[move->from])
+            lastRead[move->from] = wave;
+        lastWrite[move->to] = wave;
+        if (wave + 1 > waves)
+            waves = wave + 1;
+    }
+
+    // Bucket moves by wave, then sort each wave by source so neighbours can be merged
+    int *bucketStart = calloc(waves + 1, sizeof(int));
+    BlockMove *sorted = malloc((plan->moveCount + 1) * sizeof(BlockMove));
+    for (int i = 0; i < plan->moveCount; i++)
+        bucketStart[moveWave[i] + 1]++;
+    for (int w = 0; w < waves; w++)
+        bucketStart[w + 1] += bucketStart[w];
+    int *fill = malloc((waves + 1) * sizeof(int));
+    memcpy(fill, bucketStart, (waves + 1) * sizeof(int));
+    for (int i = 0; i < plan->moveCount; i++)
+        sorted[fill[moveWave[i]]++] = plan->moves[i];
+
+    BlockTransfer *transfers = malloc((plan->moveCount + 1) * sizeof(BlockTransfer));
+    int transferCount = 0;
+    *waveStart = malloc((waves + 1) * sizeof(int));
+
+    for (int w = 0; w < waves; w++)
+    {
+        BlockMove *moves = sorted + bucketStart[w];
+        int count = bucketStart[w + 1] - bucketStart[w];
+        qsort(moves, count, sizeof(BlockMove), compareMoveSource);
+
+        (*waveStart)[w] = transferCount;
+        for (int i = 0; i < count; i++)
+        {
+            BlockTransfer *last = transferCount > (*waveStart)[w] ? &transfers[transferCount - 1] : NULL;
+            if (last != NULL && last->count < MAX_TRANSFER_BLOCKS &&
+                moves[i].from == last->from + last->count && moves[i].to == last->to + last->count)
+            {
+                last->count++;
+            }
+            else
+            {
+                transfers[transferCount].from = moves[i].from;
+                transfers[transferCount].to = moves[i].to;
+                transfers[transferCount].count = 1;
+                transferCount++;
+            }
+        }
+    }
+    (*waveStart)[waves] = transferCount;
+    *waveCount = waves;
+
+    free(lastRead);
+    free(lastWrite);
+    free(moveWave);
+    free(bucketStart);
+    free(fill);
+    free(sorted);
+    return transfers;
+}
+
+void recordQueueDepth(EngineStats *stats, int depth)
+{
+    if (depth > stats->maxQueueDepth)
+        stats->maxQueueDepth = depth;
+    stats->queueDepthSum += depth;
+    stats->queueDepthSamples++;
+}
+
+#ifdef __linux__
+typedef struct
+{
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+} IoRing;
+
+int ioRingSetup(IoRing *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cqRingSize > ring->sqRingSize)
+            ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED)
+    {
+        close(ring->fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cqRing = ring->sqRing;
+    else
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cqRing == MAP_FAILED)
+    {
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (ring->cqRing != ring->sqRing)
+            munmap(ring->cqRing, ring->cqRingSize);
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(ring->fd);
+        return -1;
+    }
+
+    unsigned char *sq = ring->sqRing;
+    unsigned char *cq = ring->cqRing;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+void ioRingClose(IoRing *ring)
+{
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+void ioRingQueue(IoRing *ring, int opcode, void *buffer, size_t bytes, off_t offset, uint64_t userData, int flags)
+{
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = flags;
+    sqe->fd = imageFd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = bytes;
+    sqe->off = offset;
+    sqe->user_data = userData;
+
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Submits everything queued that the kernel hasn't taken yet and waits for at least minComplete completions,
+// retrying when interrupted. Returns 0 on success.
+int ioRingEnter(IoRing *ring, unsigned minComplete)
+{
+    while (1)
+    {
+        unsigned toSubmit = *ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+        int result = syscall(__NR_io_uring_enter, ring->fd, toSubmit, minComplete, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (result >= 0 && (unsigned)result >= toSubmit)
+            return 0;
+        if (result < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return -1;
+    }
+}
+
+// Runs every wave through io_uring with up to queueDepth transfers in flight, each a linked read and write.
+// Returns 0 on success and -1 on failure, with *wavesDone set to the waves that finished in full. A wave
+// that was cut short can run again, as none of its moves touches another one's blocks, but the waves after
+// it must not run before it: one of them may overwrite a block it reads from.
+int runWavesIoUring(const BlockTransfer *transfers, const int *waveStart, int waves, int queueDepth, EngineStats *stats, int *wavesDone)
+{
+    IoRing ring;
+    *wavesDone = 0;
+    if (ioRingSetup(&ring, queueDepth * 2) == -1)
+        return -1;
+
+    unsigned char *buffers = malloc((size_t)queueDepth * MAX_TRANSFER_BLOCKS * BLOCK_SIZE);
+    int *freeSlots = malloc(queueDepth * sizeof(int));
+    int *pending = calloc(queueDepth, sizeof(int));
+    size_t *slotBytes = malloc(queueDepth * sizeof(size_t)); // Every read and write of a slot moves this much
+    int freeCount = queueDepth;
+    int failed = 0;
+    for (int i = 0; i < queueDepth; i++)
+        freeSlots[i] = i;
+
+    for (int w = 0; w < waves && !failed; w++)
+    {
+        int next = waveStart[w];
+        int inFlight = 0;
+
+        while ((next < waveStart[w + 1] || inFlight > 0) && !failed)
+        {
+            while (next < waveStart[w + 1] && freeCount > 0)
+            {
+                const BlockTransfer *transfer = &transfers[next++];
+                int slot = freeSlots[--freeCount];
+                unsigned char *buffer = buffers + (size_t)slot * MAX_TRANSFER_BLOCKS * BLOCK_SIZE;
+                size_t bytes = (size_t)transfer->count * BLOCK_SIZE;
+
+                ioRingQueue(&ring, IORING_OP_READ, buffer, bytes, payloadOffset(transfer->from), (uint64_t)slot * 2, IOSQE_IO_LINK);
+                ioRingQueue(&ring, IORING_OP_WRITE, buffer, bytes, payloadOffset(transfer->to), (uint64_t)slot * 2 + 1, 0);
+                pending[slot] = 2;
+                slotBytes[slot] = bytes;
+                inFlight++;
+                recordQueueDepth(stats, inFlight);
+            }
+
+            if (ioRingEnter(&ring, 1) != 0)
+            {
+                failed = 1;
+                break;
+            }
+
+            unsigned head = *ring.cqHead;
+            while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+            {
+                struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+                int slot = cqe->user_data / 2;
+                if (cqe->res < 0 || (size_t)cqe->res != slotBytes[slot])
+                    failed = 1; // A short read or write counts as a failure too
+                if (--pending[slot] == 0)
+                {
+                    freeSlots[freeCount++] = slot;
+                    inFlight--;
+                }
+                head++;
+            }
+            __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+        }
+        if (!failed)
+            *wavesDone = w + 1;
+    }
+
+    // Let anything still in flight finish before the buffers go away
+    while (freeCount < queueDepth)
+    {
+        if (ioRingEnter(&ring, 1) != 0)
+            break; // The ring is unusable, leaking the buffers beats freeing them under the kernel
+
+        unsigned head = *ring.cqHead;
+        while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+        {
+            int slot = ring.cqes[head & *ring.cqMask].user_data / 2;
+            if (--pending[slot] == 0)
+                freeSlots[freeCount++] = slot;
+            head++;
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    if (freeCount == queueDepth)
+        free(buffers);
+    free(freeSlots);
+    free(pending);
+    free(slotBytes);
+    ioRingClose(&ring);
+    return failed ? -1 : 0;
+}
+#endif
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t workReady;
+    pthread_cond_t workDone;
+    const BlockTransfer *transfers;
+    int next;      // next transfer to hand out
+    int end;       // end of the current wave
+    int completed; // transfers finished in the current wave
+    int inFlight;
+    int failed;
+    int stopping;
+    EngineStats *stats;
+} IoPool;
+
+void *ioWorker(void *arg)
+{
+    IoPool *pool = arg;
+    unsigned char *buffer = malloc((size_t)MAX_TRANSFER_BLOCKS * BLOCK_SIZE);
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (pool->next == pool->end && !pool->stopping)
+            pthread_cond_wait(&pool->workReady, &pool->lock);
+        if (pool->stopping)
+            break;
+
+        const BlockTransfer *transfer = &pool->transfers[pool->next++];
+        pool->inFlight++;
+        recordQueueDepth(pool->stats, pool->inFlight);
+        pthread_mutex_unlock(&pool->lock);
+
+        int result = copyTransfer(transfer, buffer);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->inFlight--;
+        if (result != 0)
+            pool->failed = 1;
+        pool->completed++;
+        pthread_cond_broadcast(&pool->workDone);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(buffer);
+    return NULL;
+}
+
+// Runs every wave on a pool of threads doing blocking pread/pwrite, waiting for each wave to drain.
+// Stops after a wave with a failed transfer; *wavesDone counts the waves that finished in full.
+int runWavesThreadPool(const BlockTransfer *transfers, const int *waveStart, int waves, int queueDepth, EngineStats *stats,
+                       int *wavesDone)
+{
+    int workerCount = queueDepth < MAX_IO_WORKERS ? queueDepth : MAX_IO_WORKERS;
+    pthread_t workers[MAX_IO_WORKERS];
+    IoPool pool = {0};
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.workReady, NULL);
+    pthread_cond_init(&pool.workDone, NULL);
+    pool.transfers = transfers;
+    pool.stats = stats;
+
+    for (int i = 0; i < workerCount; i++)
+        pthread_create(&workers[i], NULL, ioWorker, &pool);
+
+    *wavesDone = 0;
+    for (int w = 0; w < waves && !pool.failed; w++)
+    {
+        pthread_mutex_lock(&pool.lock);
+        pool.next = waveStart[w];
+        pool.end = waveStart[w + 1];
+        pool.completed = 0;
+        pthread_cond_broadcast(&pool.workReady);
+        while (pool.completed < waveStart[w + 1] - waveStart[w])
+            pthread_cond_wait(&pool.workDone, &pool.lock);
+        if (!pool.failed)
+            *wavesDone = w + 1;
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.workReady);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < workerCount; i++)
+        pthread_join(workers[i], NULL);
+
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.workReady);
+    pthread_cond_destroy(&pool.workDone);
+    return pool.failed ? -1 : 0;
+}
+
+// Moves the payloads of a plan through the batched engine, then applies the block table changes.
+// Returns 0 on success. On failure the block table is only brought up to the last wave that finished, so
+// the image stays consistent with part of the plan done: a wave cut short wrote nothing but free blocks.
+int runMoveEngine(const MovePlan *plan, int queueDepth, EngineStats *stats)
+{
+    int *waveStart;
+    int waves;
+    BlockTransfer *transfers = buildTransfers(plan, &waveStart, &waves);
+    struct timespec start;
+    int result = -1;
+    int wavesDone = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->waves = waves;
+    stats->transfers = waveStart[waves];
+    stats->moves = plan->moveCount;
+
+    // Anything written through the mapping has to reach the file before it is read back with pread
+    msync(diskHeader, diskHeader->imageSize, MS_SYNC);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+#ifdef __linux__
+    stats->backend = "io_uring";
+    result = runWavesIoUring(transfers, waveStart, waves, queueDepth, stats, &wavesDone);
+#endif
+    if (result != 0)
+    {
+        // Carry on from the first wave that didn't finish. Waves before it must not run again: a later
+        // wave may already have overwritten a block they read from.
+        stats->backend = wavesDone > 0 ? "io_uring, then thread pool" : "thread pool";
+        if (wavesDone == 0)
+        {
+            stats->maxQueueDepth = 0;
+            stats->queueDepthSum = 0;
+            stats->queueDepthSamples = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+        int poolWavesDone;
+        result = runWavesThreadPool(transfers, waveStart + wavesDone, waves - wavesDone, queueDepth, stats, &poolWavesDone);
+        wavesDone += poolWavesDone;
+    }
+    stats->seconds = secondsSince(&start);
+
+    if (result == 0)
+    {
+        for (int i = 0; i < plan->moveCount; i++)
+            moveBlockRecord(plan->moves[i].from, plan->moves[i].to);
+    }
+    else
+    {
+        // Wave order keeps every move after the ones it depends on, like plan order does
+        for (int t = 0; t < waveStart[wavesDone]; t++)
+        {
+            for (int b = 0; b < transfers[t].count; b++)
+                moveBlockRecord(transfers[t].from + b, transfers[t].to + b);
+        }
+    }
+    stats->wavesDone = wavesDone;
+
+    free(transfers);
+    free(waveStart);
+    return result;
+}
+
+void printEngineStats(const EngineStats *stats)
+{
+    double megabytes = (double)stats->moves * BLOCK_SIZE / (1024.0 * 1024.0);
+    printf("\nI/O engine (%s)\n------\n", stats->backend);
+    printf("Moves: %d in %d transfers over %d waves\n", stats->moves, stats->transfers, stats->waves);
+    printf("Moved: %.2f MiB in %.3f s (%.1f MB/s)\n", megabytes, stats->seconds,
+           stats->seconds > 0 ? megabytes / stats->seconds : 0.0);
+    printf("Queue depth: avg %.1f, max %d\n",
+           stats->queueDepthSamples ? stats->queueDepthSum / stats->queueDepthSamples : 0.0, stats->maxQueueDepth);
+}
+
+int markDefragInterrupted();
+
+// Returns 0 once the disk is defragmented, -1 if the block I/O failed partway.
+int defragmentBatched()
+{
+    if (imageFd == -1)
+    {
+        printf("Batched I/O needs a disk image file, defragmenting in memory instead.\n");
+        defragment();
+        return 0;
+    }
+
+    MovePlan plan;
+    EngineStats stats;
+    pthread_mutex_lock(&diskLock);
+    diskVersion++;
+    planDefragmentation(&plan);
+
+    if (runMoveEngine(&plan, ioQueueDepth, &stats) != 0)
+    {
+        int marked = markDefragInterrupted();
+        pthread_mutex_unlock(&diskLock);
+        printf("Block I/O failed after %d of %d waves, the disk is only partly defragmented.\n", stats.wavesDone,
+               stats.waves);
+        if (marked)
+            printf("The defrag will resume the next time the image is opened.\n");
+        freeMovePlan(&plan);
+        return -1;
+    }
+
+    printPlanSummary(&plan);
+    printEngineStats(&stats);
+    freeMovePlan(&plan);
+
+    int badBlocks = verifyPayloads();
+    pthread_mutex_unlock(&diskLock);
+    if (badBlocks == 0)
+        printf("Block data verified.\n");
+    else
+        printf("Block data check failed: %d corrupt block(s).\n", badBlocks);
+    return 0;
+}
+
+// Move journal
+// ------
+// A sequential defrag of an image file runs its plan in the batched engine's waves, whose moves never
+// touch each other's blocks. Before a group of waves runs, their transfers are appended to <image>.journal
+// in one write and made durable with one fdatasync, and the image header counts the waves that have run.
+// If the process dies the mapping's writes are already in the page cache, so the only damage is the wave
+// it was in the middle of, possibly with one block half relinked. Opening the image again finishes every
+// journaled wave from the header's count on: a move of such a wave has happened exactly when its source
+// is free, and redoing one that was cut short rewrites the same links. Every JOURNAL_CHECKPOINT_GROUPS
+// groups the image is msynced and the journal starts over from a checkpoint record, so recovery only ever
+// reads back to the last checkpoint. The msync costs about as much as writing back what was moved since
+// the last one, hence the long interval. A finished run just empties the journal: like an unjournaled
+// defrag, its last moves reach the file when the image is synced or closed.
+
+#define JOURNAL_MAGIC 0x4C4E524Au    // "JRNL"
+#define JOURNAL_WAVE 1               // Followed by the wave's transfers
+#define JOURNAL_CHECKPOINT 2         // Everything before it is in the image
+#define JOURNAL_GROUP_BYTES (1 << 20) // Records per group commit, a group holds at least one wave
+#define JOURNAL_CHECKPOINT_GROUPS 16  // Group commits between checkpoints, bounds the journal at 16 MiB
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t type;
+    uint32_t wave;     // Wave number within the run, waves finished so far for a checkpoint
+    uint32_t count;    // Transfers following a JOURNAL_WAVE record
+    uint32_t checksum; // Of the record with this field zero and of its transfers, so a torn tail is ignored
+    uint32_t unused;
+} JournalRecord;
+
+uint32_t journalChecksum(JournalRecord record, const BlockTransfer *transfers)
+{
+    uint32_t hash = 2166136261u;
+    record.checksum = 0;
+    const unsigned char *bytes = (const unsigned char *)&record;
+    for (size_t i = 0; i < sizeof(record); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    bytes = (const unsigned char *)transfers;
+    for (size_t i = 0; i < (size_t)record.count * sizeof(BlockTransfer); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+void bufferJournalRecord(uint32_t type, uint32_t wave, const BlockTransfer *transfers, int count)
+{
+    size_t size = sizeof(JournalRecord) + (size_t)count * sizeof(BlockTransfer);
+    if (journal.bufferUsed + size > journal.bufferCapacity)
+    {
+        journal.bufferCapacity = journal.bufferCapacity * 2 > journal.bufferUsed + size ? journal.bufferCapacity * 2 : journal.bufferUsed + size;
+        journal.buffer = realloc(journal.buffer, journal.bufferCapacity);
+    }
+
+    JournalRecord record = {JOURNAL_MAGIC, type, wave, count, 0, 0};
+    record.checksum = journalChecksum(record, transfers);
+    memcpy(journal.buffer + journal.bufferUsed, &record, sizeof(record));
+    if (count > 0)
+        memcpy(journal.buffer + journal.bufferUsed + sizeof(record), transfers, (size_t)count * sizeof(BlockTransfer));
+    journal.bufferUsed += size;
+}
+
+// Appends the buffered records, and makes them durable when sync is set. Returns 0 on success.
+int flushJournal(int sync)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t written = 0;
+    while (written < journal.bufferUsed)
+    {
+        ssize_t result = write(journal.fd, journal.buffer + written, journal.bufferUsed - written);
+        if (result <= 0)
+            return -1;
+        written += result;
+    }
+    journal.run.bytes += written;
+    journal.bufferUsed = 0;
+    if (sync)
+    {
+        if (fdatasync(journal.fd) == -1)
+            return -1;
+        journal.run.groups++;
+    }
+    journal.run.journalSeconds += secondsSince(&start);
+    return 0;
+}
+
+// Gets every move so far into the image file and starts the journal over from a checkpoint record.
+// Returns 0 on success.
+int checkpointJournal(int wavesDone)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (msync(diskHeader, diskHeader->imageSize, MS_SYNC) == -1 || ftruncate(journal.fd, 0) == -1)
+        return -1;
+    journal.run.checkpoints++;
+    journal.run.journalSeconds += secondsSince(&start);
+
+    bufferJournalRecord(JOURNAL_CHECKPOINT, wavesDone, NULL, 0);
+    return flushJournal(0); // Synced with the next group
+}
+
+// Stops journaling after a journal write failed. The journal is emptied first, so that records of waves
+// that then run unjournaled are never replayed.
+void abandonJournal()
+{
+    renderStatus("Failed to write the defrag journal, carrying on without it.");
+    if (ftruncate(journal.fd, 0) == -1)
+        unlink(journal.path);
+    close(journal.fd);
+    journal.fd = -1;
+    journal.bufferUsed = 0;
+}
+
+// Leaves a lone checkpoint record in the journal after a batched defrag failed partway, so the next open
+// finds an interrupted defrag with nothing to redo and plans the rest. The block table must already match
+// the image. Returns 1 if the mark was made durable.
+int markDefragInterrupted()
+{
+    if (journal.fd == -1)
+        return 0;
+
+    bufferJournalRecord(JOURNAL_CHECKPOINT, 0, NULL, 0);
+    if (msync(diskHeader, diskHeader->imageSize, MS_SYNC) == -1 || flushJournal(1) != 0)
+    {
+        journal.bufferUsed = 0;
+        return 0;
+    }
+    return 1;
+}
+
+void addJournalStats(JournalStats *total, const JournalStats *run)
+{
+    total->groups += run->groups;
+    total->waves += run->waves;
+    total->moves += run->moves;
+    total->bytes += run->bytes;
+    total->checkpoints += run->checkpoints;
+    total->journalSeconds += run->journalSeconds;
+    total->runSeconds += run->runSeconds;
+}
+
+// Runs a plan wave by wave, journaling each group of waves before it runs. Carries on unjournaled if the
+// journal can't be written.
+void applyPlanJournaled(const MovePlan *plan)
+{
+    int *waveStart;
+    int waves;
+    int groups = 0;
+    struct timespec start;
+    BlockTransfer *transfers = buildTransfers(plan, &waveStart, &waves);
+
+    memset(&journal.run, 0, sizeof(journal.run));
+    diskHeader->journalWavesDone = 0; // Before any wave of this run is journaled
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int w = 0; w < waves;)
+    {
+        // The header counts finished waves, so a bigger group costs nothing at recovery: only its fdatasync
+        // is shared by more waves. Most defrags fit in one group.
+        int groupStart = w, groupEnd = w, groupMoves = 0;
+        size_t groupBytes = 0;
+        while (groupEnd < waves && (groupEnd == w || groupBytes < JOURNAL_GROUP_BYTES))
+        {
+            for (int t = waveStart[groupEnd]; t < waveStart[groupEnd + 1]; t++)
+                groupMoves += transfers[t].count;
+            groupBytes += sizeof(JournalRecord) + (size_t)(waveStart[groupEnd + 1] - waveStart[groupEnd]) * sizeof(BlockTransfer);
+            if (journal.fd != -1)
+                bufferJournalRecord(JOURNAL_WAVE, groupEnd, transfers + waveStart[groupEnd], waveStart[groupEnd + 1] - waveStart[groupEnd]);
+            groupEnd++;
+        }
+        if (journal.fd != -1 && flushJournal(1) != 0)
+            abandonJournal();
+
+        for (; w < groupEnd; w++)
+        {
+            for (int t = waveStart[w]; t < waveStart[w + 1]; t++)
+            {
+                for (int b = 0; b < transfers[t].count; b++)
+                {
+                    moveBlock(transfers[t].from + b, transfers[t].to + b);
+                    if (renderEnabled)
+                        animateMove(transfers[t].to + b);
+                }
+            }
+            // Recovery must not redo a wave that has finished, a later wave may have refilled its sources
+            diskHeader->journalWavesDone = w + 1;
+        }
+        if (journal.fd != -1)
+        {
+            journal.run.waves += groupEnd - groupStart;
+            journal.run.moves += groupMoves;
+        }
+
+        if (journal.fd != -1 && ++groups % JOURNAL_CHECKPOINT_GROUPS == 0 && w < waves && checkpointJournal(w) != 0)
+            abandonJournal();
+    }
+    if (journal.fd != -1 && ftruncate(journal.fd, 0) == -1)
+        abandonJournal();
+
+    journal.run.runSeconds = secondsSince(&start);
+    addJournalStats(&journal.total, &journal.run);
+    free(transfers);
+    free(waveStart);
+}
+
+void printJournalStats(const JournalStats *stats)
+{
+    printf("Journal: %ld waves (%ld moves) in %ld group commits, %.1f KiB, %ld checkpoints\n", stats->waves,
+           stats->moves, stats->groups, stats->bytes / 1024.0, stats->checkpoints);
+    printf("Journal time: %.2f ms of %.2f ms (%.1f%%)\n", stats->journalSeconds * 1000.0, stats->runSeconds * 1000.0,
+           stats->runSeconds > 0 ? 100.0 * stats->journalSeconds / stats->runSeconds : 0.0);
+}
+
+// Finishes the waves of an interrupted defrag that were journaled but hadn't run, in journal order, then
+// empties the journal. Reading stops at the first record that is torn or doesn't fit this disk.
+void recoverJournal()
+{
+    struct stat st;
+    if (fstat(journal.fd, &st) == -1 || st.st_size == 0)
+        return;
+
+    unsigned char *data = malloc(st.st_size);
+    size_t size = pread(journal.fd, data, st.st_size, 0) == st.st_size ? (size_t)st.st_size : 0;
+    size_t *waveOffsets = malloc((size / sizeof(JournalRecord) + 1) * sizeof(size_t));
+    int waveCount = 0;
+    int checkpointWaves = 0;
+
+    for (size_t offset = 0; offset + sizeof(JournalRecord) <= size;)
+    {
+        JournalRecord record;
+        memcpy(&record, data + offset, sizeof(record));
+        size_t recordSize = sizeof(record) + (size_t)record.count * sizeof(BlockTransfer);
+        if (record.magic != JOURNAL_MAGIC || record.count > (uint32_t)diskSize + 1 || recordSize > size - offset)
+            break;
+
+        BlockTransfer *transfers = malloc((size_t)record.count * sizeof(BlockTransfer) + 1);
+        memcpy(transfers, data + offset + sizeof(record), (size_t)record.count * sizeof(BlockTransfer));
+        int valid = journalChecksum(record, transfers) == record.checksum;
+        for (uint32_t t = 0; t < record.count && valid; t++)
+        {
+            valid = transfers[t].count > 0 && transfers[t].from >= 0 && transfers[t].to >= 0 &&
+                    transfers[t].from + transfers[t].count <= diskSize + 1 && transfers[t].to + transfers[t].count <= diskSize + 1;
+        }
+        free(transfers);
+        if (!valid)
+            break;
+
+        journal.interrupted = 1;
+        if (record.type == JOURNAL_WAVE)
+            waveOffsets[waveCount++] = offset;
+        else if (record.type == JOURNAL_CHECKPOINT)
+            checkpointWaves = record.wave;
+        offset += recordSize;
+    }
+
+    for (int i = 0; i < waveCount; i++)
+    {
+        JournalRecord record;
+        memcpy(&record, data + waveOffsets[i], sizeof(record));
+        if ((int32_t)record.wave < diskHeader->journalWavesDone)
+            continue;
+
+        const unsigned char *transferData = data + waveOffsets[i] + sizeof(record);
+        for (uint32_t t = 0; t < record.count; t++)
+        {
+            BlockTransfer transfer;
+            memcpy(&transfer, transferData + t * sizeof(BlockTransfer), sizeof(transfer));
+            for (int b = 0; b < transfer.count; b++)
+            {
+                DiskBlock *source = blockAt(transfer.from + b);
+                if (source->occupied)
+                {
+                    moveBlock(transfer.from + b, transfer.to + b);
+                    journal.recoveredMoves++;
+                }
+                else
+                {
+                    // Already moved, it may only have been cut short before its fields were cleared
+                    source->nextBlockIndex = -1;
+                    source->prevBlockIndex = -1;
+                    source->fileId = -1;
+                }
+            }
+        }
+        journal.recoveredWaves++;
+    }
+    free(waveOffsets);
+    free(data);
+
+    if (journal.interrupted)
+    {
+        rebuildFragmentationMetrics(0); // File layouts may have been counted halfway through a move
+        printf("Found an interrupted defrag in %s: %d waves were done at the last checkpoint, finished %d more (%ld moves).\n",
+               journal.path, checkpointWaves, journal.recoveredWaves, journal.recoveredMoves);
+    }
+    diskHeader->journalWavesDone = 0;
+    msync(diskHeader, diskHeader->imageSize, MS_SYNC);
+    if (ftruncate(journal.fd, 0) == -1)
+        perror("Failed to empty the defrag journal");
+}
+
+// Opens the image's journal, finishing an interrupted defrag it records if the image already existed.
+// Without a journal file defrags just run unjournaled.
+void openJournal(const char *imagePath, int existing)
+{
+    journal.path = malloc(strlen(imagePath) + sizeof(".journal"));
+    sprintf(journal.path, "%s.journal", imagePath);
+    journal.fd = open(journal.path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (journal.fd == -1)
+    {
+        perror("Failed to open the defrag journal");
+        return;
+    }
+
+    if (existing)
+        recoverJournal();
+    else if (ftruncate(journal.fd, 0) == -1) // Left over from an image that has since been replaced
+        perror("Failed to empty the defrag journal");
+}
+
+void closeJournal()
+{
+    if (journal.fd != -1)
+    {
+        struct stat st;
+        if (fstat(journal.fd, &st) == 0 && st.st_size == 0)
+            unlink(journal.path);
+        close(journal.fd);
+    }
+    free(journal.path);
+    free(journal.buffer);
+    memset(&journal, 0, sizeof(journal));
+    journal.fd = -1;
+}
+
+// Parallel defragmentation
+// ------
+// Worker threads claim whole chains and cycles of the plan with an atomic counter and move their payloads
+// and block records through the mapping. The components before independentMoves never share a block, so
+// workers need no lock between them; cycles that had to share the last scratch block run afterwards on the
+// calling thread. Links can't be fixed up move by move, as a block's neighbours may belong to another
+// component, but the finished layout has every file back to back: a second pass gives each worker a range
+// of the disk and derives the links, first blocks and file layouts from the file IDs alone.
+
+#define MAX_DEFRAG_THREADS 64
+
+typedef struct
+{
+    const MovePlan *plan;
+    int components;    // Independent components, the ones workers may run in any order
+    int nextComponent; // Next component to claim
+} ParallelJob;
+
+typedef struct
+{
+    pthread_t thread;
+    ParallelJob *job;
+    long moves;
+    int firstBlock; // Range of the finished layout the worker links up
+    int endBlock;
+} ParallelWorker;
+
+int countIndependentComponents(const MovePlan *plan)
+{
+    int components = 0;
+    while (components < plan->componentCount && plan->componentStart[components] < plan->independentMoves)
+        components++;
+    return components;
+}
+
+int componentEnd(const MovePlan *plan, int component)
+{
+    return component + 1 < plan->componentCount ? plan->componentStart[component + 1] : plan->moveCount;
+}
+
+// Moves a block's payload and its table entry, leaving the links for linkDefraggedRange().
+void moveBlockContents(int from, int to)
+{
+    memcpy(blockData(to), blockData(from), BLOCK_SIZE);
+    disk[to] = disk[from];
+    disk[from].occupied = 0;
+    disk[from].fileId = -1;
+    disk[from].nextBlockIndex = -1;
+    disk[from].prevBlockIndex = -1;
+}
+
+void *parallelDefragWorker(void *arg)
+{
+    ParallelWorker *worker = arg;
+    ParallelJob *job = worker->job;
+    const MovePlan *plan = job->plan;
+
+    while (1)
+    {
+        int component = __atomic_fetch_add(&job->nextComponent, 1, __ATOMIC_RELAXED);
+        if (component >= job->components)
+            break;
+
+        for (int i = plan->componentStart[component]; i < componentEnd(plan, component); i++)
+        {
+            moveBlockContents(plan->moves[i].from, plan->moves[i].to);
+        }
+        worker->moves += componentEnd(plan, component) - plan->componentStart[component];
+    }
+    return NULL;
+}
+
+// Links the blocks of a defragmented disk in [firstBlock, endBlock). Every file is contiguous by now, so a
+// block's neighbours are the blocks either side with the same file ID. The worker holding a file's first
+// block owns its file table entry; file IDs are only read, so ranges can run side by side.
+void *linkDefraggedRange(void *arg)
+{
+    ParallelWorker *worker = arg;
+    int blockCount = worker->job->plan->blockCount;
+
+    for (int i = worker->firstBlock; i < worker->endBlock; i++)
+    {
+        int fileId = disk[i].fileId;
+        disk[i].prevBlockIndex = i > 0 && disk[i - 1].fileId == fileId ? i - 1 : -1;
+        disk[i].nextBlockIndex = i + 1 < blockCount && disk[i + 1].fileId == fileId ? i + 1 : -1;
+        if (disk[i].prevBlockIndex == -1)
+        {
+            files[fileId].firstBlockIndex = i;
+            files[fileId].contiguousLinks = files[fileId].blockCount - 1;
+        }
+    }
+    return NULL;
+}
+
+void runDefragWorkers(ParallelWorker *workers, int threadCount, void *(*work)(void *))
+{
+    for (int t = 0; t < threadCount; t++)
+    {
+        pthread_create(&workers[t].thread, NULL, work, &workers[t]);
+    }
+    for (int t = 0; t < threadCount; t++)
+    {
+        pthread_join(workers[t].thread, NULL);
+    }
+}
+
+// Runs a whole plan on threadCount threads, payloads and block table both, then brings the fragmentation
+// metrics up to date. Returns the wall-clock time in seconds and fills movesPerWorker when it isn't NULL.
+double runParallelDefrag(const MovePlan *plan, int threadCount, long *movesPerWorker)
+{
+    ParallelWorker workers[MAX_DEFRAG_THREADS];
+    ParallelJob job = {plan, countIndependentComponents(plan), 0};
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 0; t < threadCount; t++)
+    {
+        workers[t].job = &job;
+        workers[t].moves = 0;
+        workers[t].firstBlock = (int)((long)plan->blockCount * t / threadCount);
+        workers[t].endBlock = (int)((long)plan->blockCount * (t + 1) / threadCount);
+    }
+    runDefragWorkers(workers, threadCount, parallelDefragWorker);
+
+    // Cycles sharing a scratch block, in order
+    for (int i = plan->independentMoves; i < plan->moveCount; i++)
+    {
+        moveBlockContents(plan->moves[i].from, plan->moves[i].to);
+    }
 
-void initializeDisk()
-{
-    for (int i = 0; i < ROWS; i++)
+    runDefragWorkers(workers, threadCount, linkDefraggedRange);
+    if (movesPerWorker != NULL)
     {
-        for (int j = 0; j < COLUMNS; j++)
-        {
-            disk[i][j].occupied = 0;
-            disk[i][j].nextBlockIndex = -1; // -1 indicates no next block
-            strcpy(disk[i][j].fileName, "");
-        }
+        for (int t = 0; t < threadCount; t++)
+            movesPerWorker[t] = workers[t].moves;
     }
+
+    // Every file is one extent now; only the free space side needs a pass over the disk
+    metrics.totalExtents = metrics.nonEmptyFiles;
+    metrics.fragmentedFiles = 0;
+    discardFreeSpaceMetrics();
+    return secondsSince(&start);
 }
 
-// returns the first unoccupied block it finds.
-int findFirstEmptyBlock()
+// Returns 0 once the disk is defragmented, -1 if it was left alone.
+int defragmentParallel()
 {
-    for (int i = 0; i < DISK_SIZE; i++)
+    int threadCount;
+    long movesPerWorker[MAX_DEFRAG_THREADS];
+
+    printf("\nEnter the number of threads (1-%d): ", MAX_DEFRAG_THREADS);
+    scanf("%d", &threadCount);
+    if (threadCount < 1 || threadCount > MAX_DEFRAG_THREADS)
     {
-        int row = i / COLUMNS;
-        int col = i % COLUMNS;
-        if (!disk[row][col].occupied)
-        {
-            return i;
-        }
+        printf("Invalid thread count, the disk was not defragmented.\n");
+        return -1;
     }
-    // Return -1 if no unoccupied blocks found.
-    return -1;
-}
 
-int selectRandomUnoccupiedBlock()
-{
-    int blockIndex = rand() % DISK_SIZE;
-    int row = blockIndex / COLUMNS;
-    int col = blockIndex % COLUMNS;
-    while (disk[row][col].occupied)
+    MovePlan plan;
+    pthread_mutex_lock(&diskLock);
+    diskVersion++;
+    planDefragmentation(&plan);
+    double seconds = runParallelDefrag(&plan, threadCount, movesPerWorker);
+    int badBlocks = verifyPayloads();
+    pthread_mutex_unlock(&diskLock);
+
+    printPlanSummary(&plan);
+    printf("\nParallel run\n------\n");
+    printf("Threads: %d, independent chains and cycles: %d of %d\n", threadCount,
+           countIndependentComponents(&plan), plan.componentCount);
+    for (int t = 0; t < threadCount; t++)
     {
-        blockIndex = rand() % DISK_SIZE;
-        row = blockIndex / COLUMNS;
-        col = blockIndex % COLUMNS;
+        printf("    Thread %d: %ld moves\n", t + 1, movesPerWorker[t]);
     }
-    return blockIndex;
+    printf("Serial moves through the shared scratch block: %d\n", plan.moveCount - plan.independentMoves);
+    printf("Time: %.3f ms (%.0f moves/s)\n", seconds * 1000.0, seconds > 0 ? plan.moveCount / seconds : 0.0);
+    freeMovePlan(&plan);
+
+    if (badBlocks == 0)
+        printf("Block data verified.\n");
+    else
+        printf("Block data check failed: %d corrupt block(s).\n", badBlocks);
+    return 0;
 }
 
-void deleteFile()
+// Background defragmentation
+// ------
+// Runs the defrag plan in short slices on its own thread. Each slice holds the disk lock for at most
+// movesPerSlice block moves, so adds and deletes from the menu wait for one slice at most. Every move leaves
+// the chains valid, so a slice can stop anywhere in the plan. Adds, deletes and foreground defrags bump
+// diskVersion; the next slice sees the stale version and plans again from the current layout, unless the
+// fragmentation metrics are under the threshold, in which case it waits for the next change. Planning
+// works on a copy of the block and file tables with the lock released, and the plan is dropped if the
+// version moved on meanwhile, so the lock is only held for the copy.
+
+typedef struct
 {
-    printf("\n\nFiles\n------\n");
-    for (int i = 0; i < numberOfFiles; i++)
+    pthread_t thread;
+    int running;         // read and written atomically, cleared to stop the thread
+    int movesPerSlice;   // I/O budget: blocks moved per slice while holding the disk lock
+    int sliceIntervalMs; // pause between slices, the disk is free for other work meanwhile
+    double threshold;    // plan only when the fragmentation score or free space fragmentation is above this
+    long slices;
+    long moves;
+    long replans;
+    long skippedPlans;   // layouts left alone because they were under the threshold
+    long stalePlans;     // plans dropped because the disk changed while they were made
+    double longestSliceMs;
+    DiskBlock *blockCopy; // tables the plan is made from, copied under the lock
+    FileInfo *fileCopy;
+    int fileCopyCapacity;
+    int *target;
+} OnlineDefrag;
+
+OnlineDefrag onlineDefrag;
+
+// Plans from a copy of the tables. Called with diskLock held, which it releases while planning and takes
+// back before returning. Returns 0 if the disk changed meanwhile and the plan was dropped.
+int planOnlineDefrag(OnlineDefrag *online, MovePlan *plan)
+{
+    unsigned long snapshotVersion = diskVersion;
+    int fileSlots = diskHeader->fileSlotsUsed;
+    if (fileSlots > online->fileCopyCapacity)
     {
-        printf("%d: %s\n", i + 1, files[i].fileName);
+        online->fileCopyCapacity = diskHeader->fileCapacity;
+        online->fileCopy = realloc(online->fileCopy, online->fileCopyCapacity * sizeof(FileInfo));
     }
-    printf("%d: None\n", numberOfFiles + 1);
+    memcpy(online->blockCopy, disk, (diskSize + 1) * sizeof(DiskBlock));
+    memcpy(online->fileCopy, files, fileSlots * sizeof(FileInfo));
+    pthread_mutex_unlock(&diskLock);
 
-    int fileToDelete;
-    printf("\nEnter the number of the file to delete, or %d to keep all files: ", numberOfFiles + 1);
-    scanf("%d", &fileToDelete);
-    getchar(); // consume newline left in the buffer.
+    int blockCount = computeTargetLayout(online->target, online->blockCopy, online->fileCopy, fileSlots);
+    planMovesToLayout(plan, online->target, blockCount);
+    online->replans++;
+
+    pthread_mutex_lock(&diskLock);
+    if (diskVersion != snapshotVersion)
+    {
+        freeMovePlan(plan);
+        online->stalePlans++;
+        return 0;
+    }
+    return 1;
+}
+
+void *onlineDefragThread(void *arg)
+{
+    OnlineDefrag *online = arg;
+    MovePlan plan = {0};
+    int nextMove = 0;
+    int havePlan = 0;
+    unsigned long planVersion = 0;
 
-    fileToDelete--; // convert from 1-indexed to 0-indexed
+    online->blockCopy = malloc((diskSize + 1) * sizeof(DiskBlock));
+    online->target = malloc((diskSize + 1) * sizeof(int));
 
-    if (fileToDelete >= 0 && fileToDelete < numberOfFiles)
+    while (__atomic_load_n(&online->running, __ATOMIC_ACQUIRE))
     {
-        // Unoccupy the blocks
-        DiskBlock *db = &disk[files[fileToDelete].firstBlockIndex / COLUMNS][files[fileToDelete].firstBlockIndex % COLUMNS];
-        while (db->nextBlockIndex != -1)
+        struct timespec start;
+        int moved = 0;
+
+        pthread_mutex_lock(&diskLock);
+        if (!havePlan || planVersion != diskVersion)
+        {
+            freeMovePlan(&plan);
+            nextMove = 0;
+            havePlan = 0;
+            if (!defragWorthwhile(online->threshold))
+            {
+                online->skippedPlans++;
+                havePlan = 1;
+            }
+            else
+            {
+                havePlan = planOnlineDefrag(online, &plan);
+            }
+            planVersion = diskVersion;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (moved < online->movesPerSlice && nextMove < plan.moveCount)
         {
-            db->occupied = 0;
-            db = &disk[db->nextBlockIndex / COLUMNS][db->nextBlockIndex % COLUMNS];
+            moveBlock(plan.moves[nextMove].from, plan.moves[nextMove].to);
+            nextMove++;
+            moved++;
         }
-        db->occupied = 0; // last block
+        double sliceMs = secondsSince(&start) * 1000.0;
+        pthread_mutex_unlock(&diskLock);
 
-        // Move each following FileInfo up one spot
-        for (int i = fileToDelete; i < numberOfFiles - 1; i++)
+        if (moved > 0)
         {
-            files[i] = files[i + 1];
+            online->slices++;
+            online->moves += moved;
+            if (sliceMs > online->longestSliceMs)
+                online->longestSliceMs = sliceMs;
         }
-        numberOfFiles--;
-        printf("File deleted successfully.\n");
+        usleep(online->sliceIntervalMs * 1000);
+    }
+
+    freeMovePlan(&plan);
+    free(online->blockCopy);
+    free(online->fileCopy);
+    free(online->target);
+    return NULL;
+}
+
+void startOnlineDefrag(int movesPerSlice, int sliceIntervalMs, double threshold)
+{
+    memset(&onlineDefrag, 0, sizeof(onlineDefrag));
+    onlineDefrag.movesPerSlice = movesPerSlice;
+    onlineDefrag.sliceIntervalMs = sliceIntervalMs;
+    onlineDefrag.threshold = threshold;
+    __atomic_store_n(&onlineDefrag.running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&onlineDefrag.thread, NULL, onlineDefragThread, &onlineDefrag) != 0)
+    {
+        perror("Failed to create the background defrag thread");
+        __atomic_store_n(&onlineDefrag.running, 0, __ATOMIC_RELEASE);
     }
-    else if (fileToDelete == numberOfFiles)
+}
+
+void stopOnlineDefrag()
+{
+    if (!__atomic_load_n(&onlineDefrag.running, __ATOMIC_ACQUIRE))
+        return;
+    __atomic_store_n(&onlineDefrag.running, 0, __ATOMIC_RELEASE);
+    pthread_join(onlineDefrag.thread, NULL);
+}
+
+void printOnlineDefragStats()
+{
+    printf("Background defrag: %ld moves in %ld slices, %ld plans (%ld skipped under the threshold, %ld stale), longest slice %.2f ms\n",
+           onlineDefrag.moves, onlineDefrag.slices, onlineDefrag.replans, onlineDefrag.skippedPlans, onlineDefrag.stalePlans,
+           onlineDefrag.longestSliceMs);
+}
+
+void toggleOnlineDefrag()
+{
+    if (__atomic_load_n(&onlineDefrag.running, __ATOMIC_ACQUIRE))
     {
-        printf("No files were deleted.\n");
+        stopOnlineDefrag();
+        printf("\nBackground defragmentation stopped.\n");
+        printOnlineDefragStats();
+        return;
     }
-    else
+
+    int movesPerSlice, sliceIntervalMs;
+    double thresholdPercent;
+    printf("\nEnter the I/O budget per slice (blocks): ");
+    scanf("%d", &movesPerSlice);
+    printf("Enter the pause between slices (ms): ");
+    scanf("%d", &sliceIntervalMs);
+    printf("Enter the fragmentation to start at (%%): ");
+    scanf("%lf", &thresholdPercent);
+    if (movesPerSlice <= 0 || sliceIntervalMs < 0 || thresholdPercent < 0 || thresholdPercent >= 100)
     {
-        printf("Invalid input, no files were deleted.\n");
+        printf("Invalid budget, background defragmentation not started.\n");
+        return;
     }
+
+    startOnlineDefrag(movesPerSlice, sliceIntervalMs, thresholdPercent / 100.0);
+    printf("Background defragmentation started.\n");
 }
 
-void addNewFile()
+// Headless workload driver
+// ------
+// Replays a trace of create/delete/defrag operations, or generates one from a seed, with rendering off, and
+// reports throughput, allocation latency, fragmentation over time and what every defrag cost.
+//
+// Trace format, one operation per line ('#' starts a comment):
+//     create <name> <blocks>
+//     delete <name>
+//     defrag [sequential | batched | parallel <threads>]
+
+#define SCORE_SAMPLES 20                // Fragmentation samples taken over a run
+#define GENERATED_DEFRAG_THRESHOLD 0.10 // Generated workloads only defrag above this much fragmentation
+
+typedef struct
 {
-    char newFileName[20]; // File Name
-    int blockCount;       // Number of blocks
+    long operation; // Operations done before this defrag
+    const char *mode;
+    int moves;
+    int legacyMoves;
+    double milliseconds;
+    double scoreBefore;
+    double scoreAfter;
+} DefragRun;
 
-    getchar(); // Clear the input buffer
+typedef struct
+{
+    long operations;
+    long creates, deletes, defrags;
+    long failedCreates, failedDeletes, badLines;
+    double *allocationMicros;
+    long allocationCount, allocationCapacity;
+    DefragRun *defragRuns;
+    int defragRunCount, defragRunCapacity;
+    long *scoreOperations;
+    double *scores;
+    double *fragmentedRatios; // Share of fragmented files at each sample
+    double *freeSpaceScores;  // Free space fragmentation at each sample
+    int scoreCount, scoreCapacity;
+    long sampleEvery;
+} WorkloadStats;
 
-    printf("\nEnter the file name: ");
-    fgets(newFileName, sizeof(newFileName), stdin); // input file name
-    newFileName[strcspn(newFileName, "\n")] = 0;    // remove newline from fgets
+void sampleScore(WorkloadStats *stats)
+{
+    if (stats->scoreCount == stats->scoreCapacity)
+    {
+        stats->scoreCapacity = stats->scoreCapacity ? stats->scoreCapacity * 2 : 64;
+        stats->scoreOperations = realloc(stats->scoreOperations, stats->scoreCapacity * sizeof(long));
+        stats->scores = realloc(stats->scores, stats->scoreCapacity * sizeof(double));
+        stats->fragmentedRatios = realloc(stats->fragmentedRatios, stats->scoreCapacity * sizeof(double));
+        stats->freeSpaceScores = realloc(stats->freeSpaceScores, stats->scoreCapacity * sizeof(double));
+    }
+    stats->scoreOperations[stats->scoreCount] = stats->operations;
+    stats->scores[stats->scoreCount] = fragmentationScore();
+    stats->fragmentedRatios[stats->scoreCount] = fragmentedFileRatio();
+    stats->freeSpaceScores[stats->scoreCount] = freeSpaceFragmentation();
+    stats->scoreCount++;
+}
 
-    // Get the current date
-    time_t t = time(NULL);
-    struct tm *tm = localtime(&t);
-    char newCreationDate[20];
-    strftime(newCreationDate, sizeof(newCreationDate), "%Y-%m-%d", tm);
+void recordAllocation(WorkloadStats *stats, double micros)
+{
+    if (stats->allocationCount == stats->allocationCapacity)
+    {
+        stats->allocationCapacity = stats->allocationCapacity ? stats->allocationCapacity * 2 : 1024;
+        stats->allocationMicros = realloc(stats->allocationMicros, stats->allocationCapacity * sizeof(double));
+    }
+    stats->allocationMicros[stats->allocationCount++] = micros;
+}
 
-    printf("\nEnter the number of blocks: ");
-    scanf("%d", &blockCount); // input number of blocks
-    getchar();                // To remove the newline left in the input buffer.
+void runWorkloadDefrag(WorkloadStats *stats, const char *mode, int threads)
+{
+    MovePlan plan;
+    EngineStats engineStats;
+    struct timespec start;
+    DefragRun run = {0};
 
-    FileInfo newFile;
-    strncpy(newFile.fileName, newFileName, sizeof(newFile.fileName));
-    strncpy(newFile.creationDate, newCreationDate, sizeof(newFile.creationDate));
-    newFile.firstBlockIndex = -1;
-    files[numberOfFiles] = newFile; // Add to the files array.
+    run.operation = stats->operations;
+    run.scoreBefore = fragmentationScore();
+    diskVersion++;
 
-    // Create blocks
-    int previousBlockIndex = -1;
-    for (int i = blockCount; i > 0; i--)
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    planDefragmentation(&plan);
+    if (strcmp(mode, "batched") == 0 && imageFd != -1)
     {
-        int targetIndex = findFirstEmptyBlock(); // This function returns the first unoccupied block it finds.
-        if (targetIndex == -1)
+        run.mode = "batched";
+        if (runMoveEngine(&plan, ioQueueDepth, &engineStats) != 0)
         {
-            printf("Disk is full. Cannot add more files.\n");
-            return;
+            // Part of the plan ran, plan the rest from where the block table now stands
+            freeMovePlan(&plan);
+            planDefragmentation(&plan);
+            applyPlan(&plan);
+            run.mode = "batched, then sequential";
         }
+    }
+    else if (strcmp(mode, "parallel") == 0)
+    {
+        runParallelDefrag(&plan, threads, NULL);
+        run.mode = "parallel";
+    }
+    else
+    {
+        applyPlan(&plan);
+        run.mode = "sequential";
+    }
+    run.milliseconds = secondsSince(&start) * 1000.0;
+    run.moves = plan.moveCount;
+    run.legacyMoves = plan.legacyMoves;
+    run.scoreAfter = fragmentationScore();
+    freeMovePlan(&plan);
 
-        // Init new block
-        DiskBlock newBlock;
-        strncpy(newBlock.fileName, newFileName, sizeof(newBlock.fileName));
-        newBlock.occupied = 1;
-        newBlock.nextBlockIndex = -1;
-        disk[targetIndex / COLUMNS][targetIndex % COLUMNS] = newBlock;
+    if (stats->defragRunCount == stats->defragRunCapacity)
+    {
+        stats->defragRunCapacity = stats->defragRunCapacity ? stats->defragRunCapacity * 2 : 16;
+        stats->defragRuns = realloc(stats->defragRuns, stats->defragRunCapacity * sizeof(DefragRun));
+    }
+    stats->defragRuns[stats->defragRunCount++] = run;
+}
 
-        // If this is not the first block of the file, link previous block to this
-        if (previousBlockIndex != -1)
-        {
-            disk[previousBlockIndex / COLUMNS][previousBlockIndex % COLUMNS].nextBlockIndex = targetIndex;
-        }
+// Runs one trace line. Blank lines and comments are skipped without counting as an operation.
+void runTraceLine(WorkloadStats *stats, const char *line)
+{
+    char operation[16], name[20], mode[16] = "sequential";
+    int blocks, threads = 4;
 
-        // Update firstBlockIndex in file info if this is the first block
-        else
-        {
-            files[numberOfFiles].firstBlockIndex = targetIndex;
-        }
+    if (sscanf(line, "%15s", operation) != 1 || operation[0] == '#')
+        return;
 
-        previousBlockIndex = targetIndex;
+    if (strcmp(operation, "create") == 0 && sscanf(line, "%*s %19s %d", name, &blocks) == 2 && blocks > 0)
+    {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int result = createFile(name, "", blocks);
+        recordAllocation(stats, secondsSince(&start) * 1e6);
+        stats->creates++;
+        if (result < 0)
+            stats->failedCreates++;
     }
-    // Increment the total file count.
-    numberOfFiles += 1;
-    printf("\nFile added successfully.\n");
+    else if (strcmp(operation, "delete") == 0 && sscanf(line, "%*s %19s", name) == 1)
+    {
+        int fileId = findFileId(name);
+        stats->deletes++;
+        if (fileId == -1)
+            stats->failedDeletes++;
+        else
+            removeFile(fileId);
+    }
+    else if (strcmp(operation, "defrag") == 0)
+    {
+        sscanf(line, "%*s %15s %d", mode, &threads);
+        if (threads < 1 || threads > MAX_DEFRAG_THREADS)
+            threads = 4;
+        runWorkloadDefrag(stats, mode, threads);
+        stats->defrags++;
+    }
+    else
+    {
+        stats->badLines++;
+        return;
+    }
+
+    stats->operations++;
+    if (stats->operations % stats->sampleEvery == 0)
+        sampleScore(stats);
 }
 
-void createFiles()
+// Live files of a generated workload, kept dense so a random one can be picked and dropped in O(1)
+typedef struct
 {
-    srand(time(NULL)); // Seed for random number generation
-    for (int i = 0; i < numberOfFiles; i++)
+    int *liveIds;
+    int liveCount;
+    int capacity;
+    long nextFileId;
+    int usedBlocks;
+} WorkloadGenerator;
+
+void addLiveFile(WorkloadGenerator *generator, int fileId)
+{
+    if (generator->liveCount == generator->capacity)
     {
-        // Generate file details
-        sprintf(files[i].fileName, "File%d", i + 1);
+        generator->capacity = generator->capacity ? generator->capacity * 2 : 1024;
+        generator->liveIds = realloc(generator->liveIds, generator->capacity * sizeof(int));
+    }
+    generator->liveIds[generator->liveCount++] = fileId;
+}
 
-        // Generate random creation date
-        time_t t = time(NULL);
-        struct tm *tm = localtime(&t);
-        int year = rand() % 25 + 2000; // Random year between 2000 and 2020
-        int month = rand() % 12 + 1;   // Random month between 1 and 12
-        int day = rand() % 28 + 1;     // Random day between 1 and 28
-        tm->tm_year = year - 1900;     // Adjust year
-        tm->tm_mon = month - 1;        // Adjust month
-        tm->tm_mday = day;             // Adjust day
-        strftime(files[i].creationDate, sizeof(files[i].creationDate), "%Y-%m-%d", tm);
+// Writes the next operation of a seeded workload into line: mostly small creates and deletes of random
+// live files, with the odd large file and an occasional defrag once the disk is fragmented enough to be
+// worth it. Deletes win when the disk is nearly full.
+// Returns the position in liveIds of the file a delete picked, -1 for other operations.
+int generateTraceLine(WorkloadGenerator *generator, char *line, size_t size)
+{
+    int roll = rand() % 100;
+    int nearlyFull = generator->usedBlocks > diskSize * 9 / 10;
 
-        files[i].firstBlockIndex = -1; // Initialize to -1
+    if (generator->liveCount > 0 && (roll < 42 || (nearlyFull && roll < 97)))
+    {
+        int position = rand() % generator->liveCount;
+        snprintf(line, size, "delete %s", files[generator->liveIds[position]].fileName);
+        return position;
+    }
+    else if (roll >= 97 && defragWorthwhile(GENERATED_DEFRAG_THRESHOLD))
+    {
+        snprintf(line, size, "defrag");
+    }
+    else
+    {
+        int blocks = rand() % 10 == 0 ? rand() % 64 + 1 : rand() % 8 + 1;
+        snprintf(line, size, "create f%ld %d", generator->nextFileId++, blocks);
+    }
+    return -1;
+}
 
-        int blockCount = rand() % 4 + 2; // Random block length from 2 to 5
-        int prevBlockIndex = -1;
+int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
 
-        for (int b = 0; b < blockCount; b++)
-        {
-            int blockIndex = selectRandomUnoccupiedBlock();
-            int row = blockIndex / COLUMNS;
-            int col = blockIndex % COLUMNS;
+double percentile(const double *sorted, long count, double fraction)
+{
+    if (count == 0)
+        return 0.0;
+    long index = (long)(fraction * (count - 1) + 0.5);
+    return sorted[index];
+}
 
-            disk[row][col].occupied = 1;
-            strcpy(disk[row][col].fileName, files[i].fileName);
+void printWorkloadReport(WorkloadStats *stats, double seconds)
+{
+    double defragMs = 0.0;
+    for (int i = 0; i < stats->defragRunCount; i++)
+        defragMs += stats->defragRuns[i].milliseconds;
 
-            // Will update if another block follows
-            disk[row][col].nextBlockIndex = -1;
+    printf("\nWorkload\n------\n");
+    printf("Disk: %dx%d blocks, %d files at the end\n", diskRows, diskColumns, diskHeader->fileCount);
+    printf("Operations: %ld (creates %ld, deletes %ld, defrags %ld)\n", stats->operations, stats->creates, stats->deletes, stats->defrags);
+    printf("Failed: %ld creates, %ld deletes, %ld unreadable lines\n", stats->failedCreates, stats->failedDeletes, stats->badLines);
+    printf("Elapsed: %.3f s, %.0f ops/sec (%.0f ops/sec without defrags)\n", seconds,
+           seconds > 0 ? stats->operations / seconds : 0.0,
+           seconds - defragMs / 1000.0 > 0 ? (stats->operations - stats->defrags) / (seconds - defragMs / 1000.0) : 0.0);
 
-            // Link from the previous block if not the first block
-            if (prevBlockIndex != -1)
-            {
-                disk[prevBlockIndex / COLUMNS][prevBlockIndex % COLUMNS].nextBlockIndex = blockIndex;
-            }
-            else
-            {
-                // Set first block for the file
-                files[i].firstBlockIndex = blockIndex;
-            }
+    qsort(stats->allocationMicros, stats->allocationCount, sizeof(double), compareDoubles);
+    printf("\nAllocation latency (us)\n------\n");
+    printf("p50: %.2f, p90: %.2f, p99: %.2f, max: %.2f\n",
+           percentile(stats->allocationMicros, stats->allocationCount, 0.50),
+           percentile(stats->allocationMicros, stats->allocationCount, 0.90),
+           percentile(stats->allocationMicros, stats->allocationCount, 0.99),
+           percentile(stats->allocationMicros, stats->allocationCount, 1.0));
 
-            prevBlockIndex = blockIndex;
-        }
+    printf("\nFragmentation score over time\n------\n");
+    for (int i = 0; i < stats->scoreCount; i++)
+        printf("    op %8ld: score %.3f, fragmented files %5.1f%%, free space fragmentation %5.1f%%\n", stats->scoreOperations[i],
+               stats->scores[i], stats->fragmentedRatios[i] * 100.0, stats->freeSpaceScores[i] * 100.0);
+
+    printf("\nDefrag cost\n------\n");
+    for (int i = 0; i < stats->defragRunCount; i++)
+    {
+        DefragRun *run = &stats->defragRuns[i];
+        printf("    op %8ld: %s, %d moves (%ld KiB, swap-based %d), %.2f ms, score %.3f -> %.3f\n",
+               run->operation, run->mode, run->moves, (long)run->moves * BLOCK_SIZE / 1024, run->legacyMoves,
+               run->milliseconds, run->scoreBefore, run->scoreAfter);
     }
+    printf("Total defrag time: %.2f ms\n", defragMs);
+    if (journal.total.runSeconds > 0)
+        printJournalStats(&journal.total);
+
+    printFragmentationMetrics();
 }
 
-void displayFiles()
+// Replays tracePath, or generates operationCount operations from seed when tracePath is NULL (writing them
+// to savePath if given). Returns the process exit code.
+int runWorkload(const char *tracePath, unsigned int seed, long operationCount, const char *savePath)
 {
-    printf("\nFiles\n------");
-    for (int i = 0; i < numberOfFiles; i++)
-    {
-        printf("\nName: %s, Creation Date: %s, First Block Index: %d\n",
-               files[i].fileName, files[i].creationDate, files[i].firstBlockIndex);
+    WorkloadStats stats = {0};
+    char line[128];
+    struct timespec start;
+    FILE *trace = NULL, *save = NULL;
 
-        int nextIndex = files[i].firstBlockIndex;
-        int fileSize = 0;
-
-        while (nextIndex != -1)
+    renderEnabled = 0;
+    if (tracePath != NULL)
+    {
+        trace = fopen(tracePath, "r");
+        if (trace == NULL)
         {
-            DiskBlock *block = &disk[nextIndex / COLUMNS][nextIndex % COLUMNS];
-            printf("    Block at [%d,%d], Next Block Index: %d\n",
-                   nextIndex / COLUMNS, nextIndex % COLUMNS, block->nextBlockIndex);
-            nextIndex = block->nextBlockIndex;
-            fileSize++;
+            perror("Failed to open trace");
+            return 1;
+        }
+        // Count the lines first so samples are spread over the whole run
+        operationCount = 0;
+        while (fgets(line, sizeof(line), trace))
+            operationCount++;
+        rewind(trace);
+    }
+    else
+    {
+        srand(seed);
+        if (savePath != NULL && (save = fopen(savePath, "w")) == NULL)
+        {
+            perror("Failed to open trace for writing");
+            return 1;
         }
-
-        printf("File Size: %d blocks\n", fileSize);
     }
-}
 
-void displayDisk(int clearPrevious)
-{
+    stats.sampleEvery = operationCount / SCORE_SAMPLES > 0 ? operationCount / SCORE_SAMPLES : 1;
+    sampleScore(&stats);
 
-    if (clearPrevious)
+    WorkloadGenerator generator = {0};
+    generator.nextFileId = 1;
+    for (int i = 0; i < diskSize; i++)
+        generator.usedBlocks += disk[i].occupied;
+    for (int i = 0; i < diskHeader->fileSlotsUsed; i++)
     {
-        for (int i = 0; i < ROWS; i++)
+        if (files[i].used)
         {
-            printf("\033[A\033[2K"); // move cursor up and clear line
+            // Generated names carry on past those already on an image from an earlier run
+            long id;
+            char rest;
+            addLiveFile(&generator, i);
+            if (sscanf(files[i].fileName, "f%ld%c", &id, &rest) == 1 && id >= generator.nextFileId)
+                generator.nextFileId = id + 1;
         }
     }
 
-    for (int i = 0; i < ROWS; i++)
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (trace != NULL)
     {
-        for (int j = 0; j < COLUMNS; j++)
+        while (fgets(line, sizeof(line), trace))
+            runTraceLine(&stats, line);
+        fclose(trace);
+    }
+    else
+    {
+        for (long i = 0; i < operationCount; i++)
         {
-            printf("%s\t", disk[i][j].occupied ? disk[i][j].fileName : "x");
+            int blocks;
+            char name[20];
+            int position = generateTraceLine(&generator, line, sizeof(line));
+
+            // Track usage from the operation itself rather than rescanning the disk
+            if (sscanf(line, "create %19s %d", name, &blocks) == 2)
+            {
+                long failedBefore = stats.failedCreates;
+                runTraceLine(&stats, line);
+                if (stats.failedCreates == failedBefore)
+                {
+                    addLiveFile(&generator, findFileId(name));
+                    generator.usedBlocks += blocks;
+                }
+            }
+            else if (position != -1)
+            {
+                int fileId = generator.liveIds[position];
+                for (int b = files[fileId].firstBlockIndex; b != -1; b = blockAt(b)->nextBlockIndex)
+                    generator.usedBlocks--;
+                generator.liveIds[position] = generator.liveIds[--generator.liveCount];
+                runTraceLine(&stats, line);
+            }
+            else
+            {
+                runTraceLine(&stats, line);
+            }
+
+            if (save != NULL)
+                fprintf(save, "%s\n", line);
         }
-        printf("\n");
+        if (save != NULL)
+            fclose(save);
     }
-    // printf("\n");
+    double seconds = secondsSince(&start);
+    if (stats.operations % stats.sampleEvery != 0)
+        sampleScore(&stats);
+
+    printWorkloadReport(&stats, seconds);
+
+    int badBlocks = verifyPayloads();
+    if (badBlocks == 0)
+        printf("Block data verified.\n");
+    else
+        printf("Block data check failed: %d corrupt block(s).\n", badBlocks);
+
+    free(generator.liveIds);
+    free(stats.allocationMicros);
+    free(stats.defragRuns);
+    free(stats.scoreOperations);
+    free(stats.scores);
+    free(stats.fragmentedRatios);
+    free(stats.freeSpaceScores);
+    return badBlocks == 0 ? 0 : 1;
 }
 
-// Define a new function to swap two blocks
-void swapBlocks(int index1, int index2)
+void printUsage(const char *program)
 {
-    // Swap blocks on the disk
-    DiskBlock temp = disk[index1 / COLUMNS][index1 % COLUMNS];
-    disk[index1 / COLUMNS][index1 % COLUMNS] = disk[index2 / COLUMNS][index2 % COLUMNS];
-    disk[index2 / COLUMNS][index2 % COLUMNS] = temp;
+    printf("Usage: %s [disk image] [rows] [columns] [move delay ms]\n", program);
+    printf("       %s --replay <trace> [--image <path>] [--rows N] [--columns N] [--no-journal] [--queue-depth N]\n", program);
+    printf("       %s --generate <seed> <operations> [--save <trace>] [--image <path>] [--rows N] [--columns N] [--no-journal] [--queue-depth N]\n", program);
+}
+
+// Parses the headless command line and runs the workload. Returns the process exit code.
+int runHeadless(int argc, char *argv[])
+{
+    const char *tracePath = NULL, *savePath = NULL, *imagePath = NULL;
+    unsigned int seed = 0;
+    long operationCount = 0;
+    int rows = 100, columns = 100;
+    int generate = 0;
 
-    // Update next block indices
-    for (int i = 0; i < ROWS; i++)
+    for (int i = 1; i < argc; i++)
     {
-        for (int j = 0; j < COLUMNS; j++)
+        if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+            tracePath = argv[++i];
+        else if (strcmp(argv[i], "--generate") == 0 && i + 2 < argc)
+        {
+            generate = 1;
+            seed = strtoul(argv[++i], NULL, 10);
+            operationCount = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc)
+            savePath = argv[++i];
+        else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc)
+            imagePath = argv[++i];
+        else if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc)
+            rows = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--columns") == 0 && i + 1 < argc)
+            columns = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--no-journal") == 0)
+            journalEnabled = 0;
+        else if (strcmp(argv[i], "--queue-depth") == 0 && i + 1 < argc)
+            ioQueueDepth = atoi(argv[++i]);
+        else
         {
-            if (disk[i][j].nextBlockIndex == index1)
-                disk[i][j].nextBlockIndex = index2;
-            else if (disk[i][j].nextBlockIndex == index2)
-                disk[i][j].nextBlockIndex = index1;
+            printUsage(argv[0]);
+            return 1;
         }
     }
 
-    // Update first block indices in files
-    for (int i = 0; i < numberOfFiles; i++)
+    if ((tracePath == NULL) == !generate || rows <= 0 || columns <= 0 || ioQueueDepth <= 0 || (generate && operationCount <= 0))
     {
-        if (files[i].firstBlockIndex == index1)
-            files[i].firstBlockIndex = index2;
-        else if (files[i].firstBlockIndex == index2)
-            files[i].firstBlockIndex = index1;
+        printUsage(argv[0]);
+        return 1;
     }
+
+    if (openDiskImage(imagePath, rows, columns) == -1)
+        return 1;
+    resumeInterruptedDefrag();
+
+    int result = runWorkload(tracePath, seed, operationCount, savePath);
+    closeDiskImage();
+    return result;
 }
 
-void defragment()
+int main(int argc, char *argv[])
 {
-    displayDisk(0);
-    // this keeps track of where we are writing to
-    int writePos = 0;
-
-    for (int i = 0; i < numberOfFiles; i++)
+    if (argc > 1 && strncmp(argv[1], "--", 2) == 0)
     {
-        int currentBlockIndex = files[i].firstBlockIndex;
-        while (currentBlockIndex != -1)
-        {
-            // Check if the current block is already in the correct position
-            if (currentBlockIndex != writePos)
-            {
-                swapBlocks(writePos, currentBlockIndex);
-                // After swapping, the current block's new position is writePos
-                currentBlockIndex = writePos;
-            }
-
-            // Move to next block in the file
-            currentBlockIndex = disk[currentBlockIndex / COLUMNS][currentBlockIndex % COLUMNS].nextBlockIndex;
+        return runHeadless(argc, argv);
+    }
 
-            // Move to the next position in the disk
-            writePos++;
+    const char *imagePath = argc > 1 ? argv[1] : NULL;
+    int rows = argc > 2 ? atoi(argv[2]) : ROWS;
+    int columns = argc > 3 ? atoi(argv[3]) : COLUMNS;
+    moveDelayMs = argc > 4 ? atoi(argv[4]) : DEFAULT_MOVE_DELAY_MS;
 
-            usleep(200000); // sleep for a short while
-            displayDisk(1);
-        }
+    if (argc < 2)
+    {
+        printUsage(argv[0]);
+    }
+    if (rows <= 0 || columns <= 0)
+    {
+        printf("Rows and columns must be positive.\n");
+        return 1;
+    }
+    if (moveDelayMs < 0)
+    {
+        printf("The move delay can't be negative.\n");
+        return 1;
     }
-}
 
-int main()
-{
-    initializeDisk();
-    createFiles();
+    int opened = openDiskImage(imagePath, rows, columns);
+    if (opened == -1)
+    {
+        return 1;
+    }
 
-    printf("Initialised disk...\n");
-    printf("Created starter files...\n");
+    if (opened)
+    {
+        printf("Opened disk image %s (%dx%d blocks, %d files)...\n", imagePath, diskRows, diskColumns, diskHeader->fileCount);
+        resumeInterruptedDefrag();
+    }
+    else
+    {
+        createFiles();
+        printf("Initialised disk...\n");
+        printf("Created starter files...\n");
+    }
 
     while (1)
     {
@@ -354,7 +3417,10 @@ int main()
         printf("3. Add a File (mission 3)\n");
         printf("4. Delete a File (mission 3)\n");
         printf("5. Defragment Disk (mission 2)\n");
-        printf("6. Exit\n");
+        printf("6. Defragment Disk with batched I/O\n");
+        printf("7. Defragment Disk in parallel\n");
+        printf("8. %s Background Defragmentation\n", __atomic_load_n(&onlineDefrag.running, __ATOMIC_ACQUIRE) ? "Stop" : "Start");
+        printf("9. Exit\n");
 
         int choice;
         scanf("%d", &choice);
@@ -362,11 +3428,15 @@ int main()
         switch (choice)
         {
         case 1:
+            pthread_mutex_lock(&diskLock);
             displayFiles();
+            pthread_mutex_unlock(&diskLock);
             break;
         case 2:
             printf("\nDisk\n------\n");
-            displayDisk(0);
+            pthread_mutex_lock(&diskLock);
+            displayDisk(FRAME_FULL);
+            pthread_mutex_unlock(&diskLock);
             break;
         case 3:
             addNewFile();
@@ -380,9 +3450,24 @@ int main()
             printf("\nDisk defragmented.\n");
             break;
         case 6:
+            printf("\nDefragmenting disk...\n");
+            if (defragmentBatched() == 0)
+                printf("\nDisk defragmented.\n");
+            break;
+        case 7:
+            printf("\nDefragmenting disk...\n");
+            if (defragmentParallel() == 0)
+                printf("\nDisk defragmented.\n");
+            break;
+        case 8:
+            toggleOnlineDefrag();
+            break;
+        case 9:
+            stopOnlineDefrag();
+            closeDiskImage();
             return 0; // Exit the program
         default:
-            printf("Invalid choice! Please enter a value between 1 and 6.\n");
+            printf("Invalid choice! Please enter a value between 1 and 9.\n");
         }
     }
     return 0;
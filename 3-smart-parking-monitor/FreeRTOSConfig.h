@@ -0,0 +1,61 @@
+#ifndef FREERTOS_CONFIG_H
+#define FREERTOS_CONFIG_H
+
+// Configuration for the FreeRTOS POSIX/Linux port (portable/ThirdParty/GCC/Posix). Every task runs
+// as a pthread, so stacks are sized for printf and friends rather than for a microcontroller.
+
+#define configUSE_PREEMPTION 1
+#define configUSE_PORT_OPTIMISED_TASK_SELECTION 0
+#define configUSE_IDLE_HOOK 0
+#define configUSE_TICK_HOOK 0
+#define configUSE_DAEMON_TASK_STARTUP_HOOK 0
+#define configTICK_RATE_HZ ((TickType_t)1000)
+#define configMAX_PRIORITIES 7
+#define configMINIMAL_STACK_SIZE ((unsigned short)4096) // Words, 32 KiB on a 64-bit host
+#define configTOTAL_HEAP_SIZE ((size_t)(64 * 1024 * 1024))
+#define configMAX_TASK_NAME_LEN 16
+#define configUSE_16_BIT_TICKS 0
+#define configIDLE_SHOULD_YIELD 1
+#define configUSE_TASK_NOTIFICATIONS 1
+#define configUSE_MUTEXES 1
+#define configUSE_RECURSIVE_MUTEXES 0
+#define configUSE_COUNTING_SEMAPHORES 1
+#define configUSE_QUEUE_SETS 0
+#define configQUEUE_REGISTRY_SIZE 0
+#define configUSE_TRACE_FACILITY 1
+#define configUSE_STATS_FORMATTING_FUNCTIONS 0
+#define configUSE_CO_ROUTINES 0
+#define configUSE_TICKLESS_IDLE 0
+#define configCHECK_FOR_STACK_OVERFLOW 0 // Not supported by the POSIX port
+#define configUSE_MALLOC_FAILED_HOOK 0
+#define configGENERATE_RUN_TIME_STATS 1 // The POSIX port supplies the run time counter, for the stats dump
+#ifdef STATIC_ALLOCATION // make parking-monitor-static, every kernel object comes from main.c's static arena
+#define configSUPPORT_STATIC_ALLOCATION 1
+#define configSUPPORT_DYNAMIC_ALLOCATION 0
+#define configKERNEL_PROVIDED_STATIC_MEMORY 1 // Idle and timer task buffers, FreeRTOS-Kernel V11.1 or later
+#else
+#define configSUPPORT_STATIC_ALLOCATION 0
+#define configSUPPORT_DYNAMIC_ALLOCATION 1
+#endif
+
+#define configUSE_TIMERS 1
+#define configTIMER_TASK_PRIORITY (configMAX_PRIORITIES - 1)
+#define configTIMER_QUEUE_LENGTH 20
+#define configTIMER_TASK_STACK_DEPTH (configMINIMAL_STACK_SIZE * 2)
+
+#define INCLUDE_vTaskPrioritySet 1
+#define INCLUDE_uxTaskPriorityGet 1
+#define INCLUDE_vTaskDelete 1
+#define INCLUDE_vTaskSuspend 1
+#define INCLUDE_vTaskDelay 1
+#define INCLUDE_xTaskDelayUntil 1
+#define INCLUDE_xTaskGetSchedulerState 1
+#define INCLUDE_xTaskGetCurrentTaskHandle 1
+#define INCLUDE_uxTaskGetStackHighWaterMark 1
+#define INCLUDE_xTaskGetIdleTaskHandle 1
+#define INCLUDE_xTimerPendFunctionCall 1
+
+#include <assert.h>
+#define configASSERT(x) assert(x)
+
+#endif // FREERTOS_CONFIG_H
@@ -4,18 +4,63 @@
 #include "semphr.h"
 #include <stdio.h>
 #include <stdbool.h>
-#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <time.h>
 #include <string.h>
-
-#define MAX_CARS 25
-#define ROWS 5
-#define COLUMNS 5
-#define FREE ""
+#include <signal.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/select.h>
+
+#define DEFAULT_LEVELS 1
+#define DEFAULT_ROWS 5
+#define DEFAULT_COLUMNS 5
+#define MAX_SPACES (4 * 1024 * 1024) // Upper limit on levels x rows x columns
+#define DISPLAY_GRID_LIMIT 100       // Bigger lots are shown as per level totals instead of grids
+#define SNAPSHOT_DIRTY_LIMIT 256     // Changes a snapshot buffer tracks per zone before it falls back to a full copy
+#define SNAPSHOT_INTERVAL_MS 50      // Shortest gap between two snapshot publishes
+#define MAX_ZONES 64                 // Most zones the lot is split into, each has its own lock
+#define PLATE_STRIPES 16             // Plate index stripes, each has its own lock
+#define MAX_GATES 16                 // Most entry or exit gates
+#define GATE_QUEUE_LENGTH 32         // Cars waiting at a gate before the traffic task has to wait as well
+#define COMMAND_QUEUE_LENGTH 4
+#define MAX_TASKS (9 + 2 * MAX_GATES) // Every task the monitor can start, gates included
+#define MAX_QUEUES (2 + 2 * MAX_GATES)
+#define MAX_MUTEXES (MAX_ZONES + PLATE_STRIPES + 2)
+
+// A static build (make parking-monitor-static) takes every buffer from one array sized at compile time for
+// a lot of up to STATIC_LEVELS x STATIC_ROWS x STATIC_COLUMNS, and never uses the heap
+#ifdef STATIC_ALLOCATION
+#ifndef STATIC_LEVELS
+#define STATIC_LEVELS 10
+#endif
+#ifndef STATIC_ROWS
+#define STATIC_ROWS 100
+#endif
+#ifndef STATIC_COLUMNS
+#define STATIC_COLUMNS 100
+#endif
+#define STATIC_SPACES ((size_t)STATIC_LEVELS * STATIC_ROWS * STATIC_COLUMNS)
+// The kernel only supplies the idle and timer task buffers itself (configKERNEL_PROVIDED_STATIC_MEMORY) from V11.1
+#if !defined(tskKERNEL_VERSION_MAJOR) || tskKERNEL_VERSION_MAJOR < 11 || \
+    (tskKERNEL_VERSION_MAJOR == 11 && tskKERNEL_VERSION_MINOR < 1)
+#error "The static build needs FreeRTOS-Kernel V11.1 or later"
+#endif
+#endif
+#define FREE_PLATE 0                 // Plate key of an empty space, no plate packs to zero
 
 #define LOG_MESSAGE_LENGTH 200
-#define MAX_LOG_MESSAGES 10
+#define MAX_LOG_MESSAGES 10 // Recent log lines kept for the display
+#define LOG_QUEUE_LENGTH 1024
+#define LOG_BATCH 64        // Records the logger formats per write
+#define LATENCY_BUCKETS 32 // Duration histograms, bucket b holds durations under 2^b microseconds
+#define STATS_MAX_TASKS 64 // Tasks the stats dump has room for
+#define OCCUPANCY_SAMPLES 120  // Occupancy samples each zone keeps, the oldest is overwritten
+#define PEAK_WINDOW_SAMPLES 60 // Samples in the busiest window, the peak hour at --sample-ms 60000
+#define KEY_ESCAPE 27
 
 // ANSI Escape Codes for coloring
 #define ANSI_COLOR_RED "\x1b[31m"
@@ -24,277 +69,1763 @@
 #define ANSI_COLOR_RESET "\x1b[0m"
 #define ANSI_COLOR_CYAN "\x1b[36m"
 
+// A number plate of up to 8 characters packed into one integer, first character in the top byte
+typedef uint64_t PlateKey;
+
+typedef enum
+{
+  ASSIGNED,
+  LOT_FULL,
+  DUPLICATE_PLATE // A car with the same plate is already parked
+} AssignResult;
+
+// Log events. The hot path only queues the event and its raw arguments, the logger task looks up the
+// format and does the printing.
+typedef enum
+{
+  LOG_ALREADY_PARKED,
+  LOG_ASSIGNED,
+  LOG_REQUESTED_TAKEN,
+  LOG_ASSIGNED_NEAREST,
+  LOG_LOT_FULL,
+  LOG_CAR_LEFT,
+  LOG_LOT_EMPTY,
+  LOG_EVENT_COUNT
+} LogEvent;
+
 typedef struct
 {
-  char text[LOG_MESSAGE_LENGTH];
-  TickType_t expiryTick;
-} LogMessage;
+  const char *format;
+  bool hasPlate; // The plate is the first argument to the format, the numbers follow
+} LogFormat;
+
+const LogFormat logFormats[LOG_EVENT_COUNT] = {
+    [LOG_ALREADY_PARKED] = {"Car with plate %s is already parked.", true},
+    [LOG_ASSIGNED] = {"Car with plate %s assigned to (%d, %d, %d).", true},
+    [LOG_REQUESTED_TAKEN] = {"Requested space (%d, %d, %d) is not free. Assigning the nearest free space...", false},
+    [LOG_ASSIGNED_NEAREST] = {"Car with plate %s assigned to the nearest free space (%d, %d, %d).", true},
+    [LOG_LOT_FULL] = {"No free parking spaces available.", false},
+    [LOG_CAR_LEFT] = {"Car %s has left from space (%d, %d, %d). Free spaces: %d", true},
+    [LOG_LOT_EMPTY] = {"Parking lot is empty. No cars to remove.", false},
+};
 
-// Registration number starts from 2001 for simplicity
-volatile char parking[ROWS][COLUMNS][9];
-volatile int freeSpaces = MAX_CARS;
-volatile char latestIncoming[9], latestOutgoing[9];
+typedef struct
+{
+  TickType_t tick;
+  uint32_t event;
+  PlateKey plate;
+  int32_t args[4];
+} LogRecord;
+
+typedef struct
+{
+  unsigned long queued;
+  unsigned long dropped; // Records lost because logQueue was full
+  unsigned long written;
+  unsigned long peakFill; // Most records the logger has found waiting
+} LogCounters;
+
+// Set from the command line, the defaults match the interactive monitor
+typedef struct
+{
+  bool headless;   // No display or manual control, report throughput and latency at the end
+  int levels;      // Lot size, a space is addressed by level, row and column
+  int rows;
+  int columns;
+  int arrivalMs;   // Pause between groups of incoming cars
+  int departureMs; // Pause between groups of outgoing cars
+  int entryGates;  // Gate tasks parking arriving cars
+  int exitGates;   // Gate tasks letting cars out
+  int seconds;     // Length of a headless run
+  int statsMs;     // Period of the stats dump, 0 for none
+  int sampleMs;    // Length of an occupancy sample
+  const char *logPath; // File the logger appends to, NULL to keep only the recent lines
+} MonitorConfig;
+
+// Durations filed under the first power of two microseconds above them
+typedef struct
+{
+  unsigned long buckets[LATENCY_BUCKETS];
+  unsigned long count;
+  uint64_t totalNs;
+  uint64_t maxNs;
+} Histogram;
+
+// Wait and hold times of a lock, only updated by the task holding it
+typedef struct
+{
+  uint64_t lockedAt;
+  Histogram waits, holds;
+} LockTimes;
+
+// Load test counters, one set per gate and only updated by that gate's task
+typedef struct
+{
+  unsigned long arrivals;
+  unsigned long rejected;   // Cars that found the lot full
+  unsigned long duplicates; // Cars turned away because their plate was already parked
+  unsigned long departures;
+  Histogram assignLatency;  // Reaching the entry gate until parked
+  Histogram removeLatency;  // Departure at the exit gate until the space is free
+} LoadStats;
+
+// Run time counters from the previous stats dump, so the next one can show CPU use in between
+typedef struct
+{
+  int count;
+  TaskHandle_t handles[STATS_MAX_TASKS];
+  uint32_t runTime[STATS_MAX_TASKS];
+  uint32_t totalRunTime;
+} StatsSample;
+
+// What the display shows, published by the snapshot task so the display never takes a lock. There
+// are two buffers: the writer updates the back one while readers copy the front one, then swaps them.
+// Each buffer has its own generation, odd while it is being written, so a reader that is still copying
+// a buffer when it is reused for the next publish notices and copies again.
+typedef struct
+{
+  uint32_t generation;
+  PlateKey latestIncoming, latestOutgoing;
+  int freeSpaces;
+  int *levelOccupied; // One per level
+  PlateKey *grid;     // Every space's plate when the lot is small enough to draw, NULL otherwise
+} ParkingSnapshot;
+
+// Time integral of the occupancy of a row or zone, only updated with its zone locked
+typedef struct
+{
+  uint64_t occupiedTicks; // Occupied spaces times ticks, summed up to changedAt
+  TickType_t changedAt;
+} SpaceUsage;
+
+// A zone's occupancy over one sample period. Buckets count sample periods since the scheduler started.
+typedef struct
+{
+  uint32_t bucket;
+  int occupied; // At the end of the period, or now for the current one
+  int peak;
+  int arrivals, departures;
+} OccupancySample;
 
-SemaphoreHandle_t parkingMutex;
-TaskHandle_t incomingTaskHandle, outgoingTaskHandle, displayTaskHandle, manualControlTaskHandle;
+// The lot's occupancy samples, oldest first, merged from the zones' rings
+typedef struct
+{
+  uint32_t firstBucket;
+  int count;
+  int occupied[OCCUPANCY_SAMPLES];
+  int arrivals[OCCUPANCY_SAMPLES];
+} OccupancySeries;
+
+// A run of consecutive rows with its own lock. Its spaces are spaceOrder[firstSpace, firstSpace + spaceCount):
+// the free ones first, then the occupied ones, so a space changes sets by swapping with the one at the
+// boundary and a random free or occupied space is one random index into its half.
+typedef struct
+{
+  SemaphoreHandle_t mutex;
+  int firstSpace, spaceCount;
+  int freeSpaces;
+  int dirtyLimit;      // Changes tracked per snapshot buffer before it falls back to copying the whole zone
+  int *dirtySpaces[2]; // Spaces changed since each snapshot buffer was last written
+  int dirtyCount[2];
+  bool fullRefresh[2];
+  LockTimes lockTimes;
+  SpaceUsage usage;
+  Histogram dwell;                            // How long cars stayed, filed as they leave
+  OccupancySample samples[OCCUPANCY_SAMPLES]; // Ring indexed by bucket % OCCUPANCY_SAMPLES
+  uint32_t latestBucket;
+} LotZone;
+
+// One stripe of the plate index: open addressing with linear probing. A slot holds the space a car is
+// parked in (-1 when empty) and the plate is read from parking[]. A space's plate is only written with
+// its stripe locked, so a probe never sees it change underneath it.
+typedef struct
+{
+  SemaphoreHandle_t mutex;
+  int *slots;
+  int mask;
+  int count;
+  LockTimes lockTimes;
+} PlateStripe;
+
+// A car reaching an entry gate, or a departure at an exit gate
+typedef struct
+{
+  PlateKey plate;     // FREE_PLATE at an exit gate, where any car in the gate's zones may leave
+  uint64_t arrivedAt; // When the car reached the gate, latency counts the wait in the queue
+} GateEvent;
+
+typedef struct
+{
+  QueueHandle_t events;
+  TaskHandle_t task;
+  int firstZone, zoneCount; // Zones an exit gate tries first, taking turns between them
+  int nextZone;
+  int entrance;             // Space an entry gate parks cars nearest to
+  uint32_t random;          // Private random state, so the gates don't queue up on rand()
+  LoadStats stats;
+} Gate;
+
+// Operator commands, parsed by the manual control task and applied by the control task
+typedef enum
+{
+  COMMAND_ADD,          // Park plate in space
+  COMMAND_REMOVE_SPACE, // Empty space
+  COMMAND_FIND,         // Look up plate
+  COMMAND_REMOVE_PLATE  // Let plate out
+} CommandType;
+
+typedef enum
+{
+  COMMAND_DONE,
+  COMMAND_SPACE_TAKEN,
+  COMMAND_SPACE_FREE,
+  COMMAND_ALREADY_PARKED,
+  COMMAND_NOT_PARKED,
+  COMMAND_NO_ROOM // The plate index is out of room
+} CommandStatus;
+
+typedef struct
+{
+  CommandStatus status;
+  int space;      // Where the car was found or removed from
+  PlateKey plate; // The car removed from a space
+} CommandResult;
+
+typedef struct
+{
+  CommandType type;
+  PlateKey plate;
+  int space;
+  TaskHandle_t replyTo;  // Notified once result has been filled in
+  CommandResult *result;
+} ControlCommand;
+
+// What the memory budget printed at startup is broken down by
+typedef enum
+{
+  MEMORY_LOT,
+  MEMORY_ZONES,
+  MEMORY_PLATE_INDEX,
+  MEMORY_FREE_INDEX,
+  MEMORY_SNAPSHOTS,
+  MEMORY_ANALYTICS,
+  MEMORY_TASKS,
+  MEMORY_QUEUES,
+  MEMORY_MUTEXES,
+  MEMORY_COMPONENTS
+} MemoryComponent;
+
+const char *memoryComponentNames[MEMORY_COMPONENTS] = {
+    [MEMORY_LOT] = "Lot",
+    [MEMORY_ZONES] = "Zone dirty lists",
+    [MEMORY_PLATE_INDEX] = "Plate index",
+    [MEMORY_FREE_INDEX] = "Free space index",
+    [MEMORY_SNAPSHOTS] = "Snapshots",
+    [MEMORY_ANALYTICS] = "Analytics",
+    [MEMORY_TASKS] = "Task stacks, TCBs",
+    [MEMORY_QUEUES] = "Queues",
+    [MEMORY_MUTEXES] = "Mutexes",
+};
+
+MonitorConfig config = {false, DEFAULT_LEVELS, DEFAULT_ROWS, DEFAULT_COLUMNS, 5000, 3000, 1, 1, 10, 0, 1000, NULL};
+struct termios savedTerminal;
+bool terminalSaved = false;
+
+size_t memoryBudget[MEMORY_COMPONENTS];
+
+#ifdef STATIC_ALLOCATION
+// Upper bound of everything createLot() and setup() allocate for the largest lot, each term matching one
+// allocation there. Every allocation is rounded up to 16 bytes, hence the last term.
+#define STATIC_ROW_WORDS ((STATIC_COLUMNS + 63) / 64)
+#define STATIC_LEVEL_ROW_WORDS ((STATIC_ROWS + 63) / 64)
+#define STATIC_ARENA_SIZE                                                                             \
+  (STATIC_SPACES * (sizeof(PlateKey) + 2 * sizeof(int)) + 4 * STATIC_LEVELS * sizeof(int) +          \
+   3 * DISPLAY_GRID_LIMIT * sizeof(PlateKey) + 2 * STATIC_SPACES * sizeof(int) +                      \
+   PLATE_STRIPES * 2 * (4 * (STATIC_SPACES / PLATE_STRIPES) + 64) * sizeof(int) +                    \
+   (size_t)STATIC_LEVELS * STATIC_ROWS * (STATIC_ROW_WORDS * sizeof(uint64_t) + sizeof(int)) +        \
+   (size_t)STATIC_LEVELS * STATIC_LEVEL_ROW_WORDS * sizeof(uint64_t) +                                \
+   STATIC_SPACES * sizeof(TickType_t) + (size_t)STATIC_LEVELS * STATIC_ROWS * sizeof(SpaceUsage) +     \
+   MAX_TASKS * (configMINIMAL_STACK_SIZE * sizeof(StackType_t) + sizeof(StaticTask_t)) +              \
+   LOG_QUEUE_LENGTH * sizeof(LogRecord) + 2 * MAX_GATES * GATE_QUEUE_LENGTH * sizeof(GateEvent) +     \
+   COMMAND_QUEUE_LENGTH * sizeof(ControlCommand) + MAX_QUEUES * sizeof(StaticQueue_t) +               \
+   MAX_MUTEXES * sizeof(StaticSemaphore_t) + (32 + 2 * MAX_ZONES + PLATE_STRIPES + 2 * MAX_TASKS + 2 * MAX_QUEUES + MAX_MUTEXES) * 16)
+
+_Alignas(16) uint8_t staticArena[STATIC_ARENA_SIZE];
+size_t staticArenaUsed;
+#endif
+
+// Registration number starts from 2001 for simplicity
+volatile PlateKey *parking; // One plate per space, indexed by spaceIndex()
+int totalSpaces;
+volatile int freeSpaces;
+volatile PlateKey latestIncoming, latestOutgoing;
+
+// Every zone's free and occupied sets, see LotZone. spacePosition[space] is where a space sits in spaceOrder.
+int *spaceOrder;
+int *spacePosition;
+int *levelOccupied; // Occupied spaces per level, updated atomically as a level can span zones
+
+// The lot is split into zones of consecutive rows so gates working in different zones never wait for each
+// other. Locks are taken zone first, then plate stripe, and anything needing several zones takes all of
+// them in order.
+LotZone zones[MAX_ZONES];
+int zoneCount;
+LockTimes allZonesLockTimes; // Every zone at once, by the snapshot task and the report
+
+// Plate to space index, split by hash into stripes with their own locks
+PlateStripe plateStripes[PLATE_STRIPES];
+
+// Free space index for nearest space searches. freeBits has a set bit per free space, rowWords words per row
+// counting rows through every level, and rowBits has a set bit per row with a free space, levelRowWords words
+// per level, so a search skips 64 full rows or columns with one word. Written with the row's zone locked;
+// searches read them without locks and check what they find once they hold the zone.
+uint64_t *freeBits;
+int *rowFree; // Free spaces per row
+uint64_t *rowBits;
+int rowWords, levelRowWords;
+
+// Occupancy analytics, kept up to date as cars park and leave so reports never scan the lot
+TickType_t *arrivedAt;  // When the car in each space parked
+SpaceUsage *rowUsage;   // One per row, indexed by level * rows + row
+TickType_t sampleTicks; // Length of an occupancy sample
+volatile uint64_t peakOccupancy; // Peak occupied spaces in the high half, the tick it was reached at in the low half
+
+ParkingSnapshot snapshots[2];
+int frontSnapshot;            // Buffer readers copy from, the other one is the writer's
+ParkingSnapshot displaySnapshot; // The display task's private copy
+
+Gate entryGates[MAX_GATES], exitGates[MAX_GATES];
+
+TaskHandle_t incomingTaskHandle, outgoingTaskHandle, displayTaskHandle, manualControlTaskHandle, loadReportTaskHandle;
+TaskHandle_t loggerTaskHandle, snapshotTaskHandle, statsTaskHandle, controlTaskHandle;
+QueueHandle_t commandQueue;
 
 QueueHandle_t logQueue;
+LogCounters logCounters;
+FILE *logFile;
+
+// The last few formatted lines, written by the logger task and read by the display
+char recentLogs[MAX_LOG_MESSAGES][LOG_MESSAGE_LENGTH];
+int recentLogCount, recentLogNext;
+SemaphoreHandle_t recentLogMutex;
+
+// Held by the display while it draws a frame and by manual control while the operator is typing, so
+// neither writes over the other. No task that takes it is waited on by one that doesn't.
+SemaphoreHandle_t consoleMutex;
 
 // Task prototypes
 void incomingCarsTask(void *params);
 void outgoingCarsTask(void *params);
+void entryGateTask(void *params);
+void exitGateTask(void *params);
+void snapshotTask(void *params);
+void statsTask(void *params);
 void displayParkingTask(void *params);
 void manualControlTask(void *params);
+void controlTask(void *params);
+void loadReportTask(void *params);
+void loggerTask(void *params);
 
-void setup()
+PlateKey encodePlate(const char *plate)
 {
-  parkingMutex = xSemaphoreCreateMutex();
-  logQueue = xQueueCreate(MAX_LOG_MESSAGES, sizeof(LogMessage));
-
-  if (logQueue == NULL)
+  PlateKey key = 0;
+  for (int i = 0; i < 8; i++)
   {
-    // Handle error in queue creation
-    printf("Failed to create log queue.\n");
+    key <<= 8;
+    if (*plate != '\0')
+    {
+      key |= (unsigned char)*plate++;
+    }
   }
+  return key;
+}
 
-  // Initialize all parking spots to FREE
-  for (int i = 0; i < ROWS; i++)
+void decodePlate(PlateKey key, char plate[9])
+{
+  for (int i = 0; i < 8; i++)
   {
-    for (int j = 0; j < COLUMNS; j++)
-    {
-      strcpy_s(parking[i][j], sizeof(char) * 9, FREE);
-    }
+    plate[i] = (char)(key >> (56 - 8 * i));
   }
+  plate[8] = '\0';
+}
 
-  xTaskCreate(incomingCarsTask, "IncomingCars", configMINIMAL_STACK_SIZE, NULL, 2, &incomingTaskHandle);
-  xTaskCreate(outgoingCarsTask, "OutgoingCars", configMINIMAL_STACK_SIZE, NULL, 2, &outgoingTaskHandle);
-  xTaskCreate(displayParkingTask, "DisplayParking", configMINIMAL_STACK_SIZE, NULL, 1, &displayTaskHandle);
-  xTaskCreate(manualControlTask, "ManualControl", configMINIMAL_STACK_SIZE, NULL, 1, &manualControlTaskHandle);
+void restoreTerminal()
+{
+  if (terminalSaved)
+  {
+    tcsetattr(STDIN_FILENO, TCSANOW, &savedTerminal);
+  }
+}
 
-  vTaskStartScheduler();
+void handleInterrupt(int signal)
+{
+  restoreTerminal();
+  _exit(0);
 }
 
-void logMessage(const char *format, ...)
+// Turns off line buffering and echo so single key presses reach the manual control task
+void enableRawInput()
 {
-  // Ensure the queue is created
-  if (logQueue == NULL)
+  if (tcgetattr(STDIN_FILENO, &savedTerminal) != 0)
   {
-    return; // Optionally, handle the uninitialized queue case
+    return; // Not a terminal, input is read as it comes
   }
+  terminalSaved = true;
 
-  LogMessage log;
-  va_list args;
+  struct termios raw = savedTerminal;
+  raw.c_lflag &= ~(ICANON | ECHO);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSANOW, &raw);
 
-  // Start variadic arguments to format the string
-  va_start(args, format);
-  vsnprintf(log.text, LOG_MESSAGE_LENGTH, format, args);
-  va_end(args);
+  atexit(restoreTerminal);
+  signal(SIGINT, handleInterrupt);
+}
 
-  log.expiryTick = xTaskGetTickCount();
+int spaceIndex(int level, int row, int column)
+{
+  return (level * config.rows + row) * config.columns + column;
+}
 
-  // Send formatted log message to the queue
-  if (xQueueSendToBack(logQueue, &log, 0) != pdPASS)
-  {
-    // Handle failed to send message
-  }
+int spaceLevel(int space)
+{
+  return space / (config.rows * config.columns);
 }
 
-void clearInputBuffer()
+int spaceRow(int space)
 {
-  int c;
-  while ((c = getchar()) != '\n' && c != EOF)
-  {
-  }
+  return space / config.columns % config.rows;
 }
 
-// A simple function to get the current system time as a string (HH:MM:SS format)
-void getCurrentTimeString(char *buffer, size_t bufferSize)
+int spaceColumn(int space)
 {
-  time_t now = time(NULL);
-  struct tm *tm_info = localtime(&now);
+  return space % config.columns;
+}
 
-  strftime(buffer, bufferSize, "%H:%M:%S", tm_info);
+bool isValidSpace(int level, int row, int column)
+{
+  return level >= 0 && level < config.levels && row >= 0 && row < config.rows && column >= 0 && column < config.columns;
 }
 
-void generateUKNumberPlate(char *plate)
+// Zone z holds rows [z * totalRows / zoneCount, (z + 1) * totalRows / zoneCount), counting rows through every level
+LotZone *spaceZone(int space)
 {
-  const char *letters = "ABCDEFGHKLMNOPRSVWY";
-  int year = 1 + rand() % 99;    // Years from 2001 to 2099
-  int isSecondHalf = rand() % 2; // Randomly decide if it's the first or second half of the year
+  int64_t row = space / config.columns;
+  return &zones[((row + 1) * zoneCount - 1) / ((int64_t)config.levels * config.rows)];
+}
 
-  if (isSecondHalf)
+// xorshift32, state must not be zero
+uint32_t nextRandom(uint32_t *state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+// Zeroed memory for count items, counted against a component of the memory budget. A static build takes
+// it from staticArena, so nothing is ever freed. Returns NULL when memory runs out.
+void *allocate(size_t count, size_t size, MemoryComponent component)
+{
+  size_t bytes = (count * size + 15) & ~(size_t)15;
+#ifdef STATIC_ALLOCATION
+  if (bytes > sizeof(staticArena) - staticArenaUsed)
   {
-    year += 50; // Add 50 for registrations in the second half of the year
+    return NULL;
   }
+  void *memory = &staticArena[staticArenaUsed];
+  staticArenaUsed += bytes;
+#else
+  void *memory = calloc(1, bytes);
+  if (memory == NULL)
+  {
+    return NULL;
+  }
+#endif
+  memoryBudget[component] += bytes;
+  return memory;
+}
 
-  // Adjust year for the actual numbering scheme
-  year = (year % 100) < 50 ? (year % 100) : ((year % 100) - 50);
+// Creates a task from the static pool or the FreeRTOS heap. Prints and returns false if it can't.
+bool startTask(TaskFunction_t task, const char *name, void *params, UBaseType_t priority, TaskHandle_t *handle)
+{
+#ifdef STATIC_ALLOCATION
+  StackType_t *stack = allocate(configMINIMAL_STACK_SIZE, sizeof(StackType_t), MEMORY_TASKS);
+  StaticTask_t *buffer = allocate(1, sizeof(StaticTask_t), MEMORY_TASKS);
+  *handle = stack != NULL && buffer != NULL ? xTaskCreateStatic(task, name, configMINIMAL_STACK_SIZE, params, priority, stack, buffer) : NULL;
+#else
+  if (xTaskCreate(task, name, configMINIMAL_STACK_SIZE, params, priority, handle) != pdPASS)
+  {
+    *handle = NULL;
+  }
+  else
+  {
+    memoryBudget[MEMORY_TASKS] += configMINIMAL_STACK_SIZE * sizeof(StackType_t) + sizeof(StaticTask_t);
+  }
+#endif
+  if (*handle == NULL)
+  {
+    printf("Failed to create the %s task.\n", name);
+    return false;
+  }
+  return true;
+}
 
-  // Generate two random letters
-  char firstLetter = letters[rand() % 19];
-  char secondLetter = letters[rand() % 19];
+QueueHandle_t createQueue(UBaseType_t length, UBaseType_t itemSize, const char *name)
+{
+  QueueHandle_t queue;
+#ifdef STATIC_ALLOCATION
+  uint8_t *storage = allocate(length, itemSize, MEMORY_QUEUES);
+  StaticQueue_t *buffer = allocate(1, sizeof(StaticQueue_t), MEMORY_QUEUES);
+  queue = storage != NULL && buffer != NULL ? xQueueCreateStatic(length, itemSize, storage, buffer) : NULL;
+#else
+  queue = xQueueCreate(length, itemSize);
+  if (queue != NULL)
+  {
+    memoryBudget[MEMORY_QUEUES] += length * itemSize + sizeof(StaticQueue_t);
+  }
+#endif
+  if (queue == NULL)
+  {
+    printf("Failed to create the %s queue.\n", name);
+  }
+  return queue;
+}
 
-  // Generate three random letters for the suffix
-  char suffix1 = letters[rand() % 19];
-  char suffix2 = letters[rand() % 19];
-  char suffix3 = letters[rand() % 19];
+SemaphoreHandle_t createMutex()
+{
+  SemaphoreHandle_t mutex;
+#ifdef STATIC_ALLOCATION
+  StaticSemaphore_t *buffer = allocate(1, sizeof(StaticSemaphore_t), MEMORY_MUTEXES);
+  mutex = buffer != NULL ? xSemaphoreCreateMutexStatic(buffer) : NULL;
+#else
+  mutex = xSemaphoreCreateMutex();
+  if (mutex != NULL)
+  {
+    memoryBudget[MEMORY_MUTEXES] += sizeof(StaticSemaphore_t);
+  }
+#endif
+  if (mutex == NULL)
+  {
+    printf("Failed to create a mutex.\n");
+  }
+  return mutex;
+}
 
-  sprintf_s(plate, sizeof(char) * 9, "%c%c%02d %c%c%c", firstLetter, secondLetter, year, suffix1, suffix2, suffix3);
+void printMemoryBudget()
+{
+  size_t total = 0;
+#ifdef STATIC_ALLOCATION
+  printf("Memory budget (static, no heap):\n");
+#else
+  printf("Memory budget (heap):\n");
+#endif
+  for (int c = 0; c < MEMORY_COMPONENTS; c++)
+  {
+    printf("  %-18s %12zu bytes\n", memoryComponentNames[c], memoryBudget[c]);
+    total += memoryBudget[c];
+  }
+  printf("  %-18s %12zu bytes\n", "Total", total);
+#ifdef STATIC_ALLOCATION
+  printf("  Static arena: %zu of %zu bytes used, sized for up to %d x %d x %d spaces\n", staticArenaUsed,
+         sizeof(staticArena), STATIC_LEVELS, STATIC_ROWS, STATIC_COLUMNS);
+#endif
+  fflush(stdout);
 }
 
-bool isParkingSpaceFree(int row, int column)
+bool allocateSnapshot(ParkingSnapshot *snapshot)
 {
-  return (strcmp(parking[row][column], FREE) == 0);
+  memset(snapshot, 0, sizeof(*snapshot));
+  snapshot->freeSpaces = totalSpaces;
+  snapshot->levelOccupied = allocate(config.levels, sizeof(int), MEMORY_SNAPSHOTS);
+  if (totalSpaces <= DISPLAY_GRID_LIMIT)
+  {
+    snapshot->grid = allocate(totalSpaces, sizeof(PlateKey), MEMORY_SNAPSHOTS);
+  }
+  return snapshot->levelOccupied != NULL && (totalSpaces > DISPLAY_GRID_LIMIT || snapshot->grid != NULL);
 }
 
-bool assignParkingSpace(char plate[9], int rowCoord, int colCoord)
+// Allocates the lot for the configured size with every space free. Returns false if memory runs out.
+bool createLot()
 {
-  // If specific coordinates are provided (non-negative), try to assign the space
-  if (rowCoord >= 0 && colCoord >= 0)
+  totalSpaces = config.levels * config.rows * config.columns;
+  int totalRows = config.levels * config.rows;
+  zoneCount = totalRows < MAX_ZONES ? totalRows : MAX_ZONES;
+
+  // Four times a stripe's share of the lot, so stripes stay under a quarter full unless plates hash very unevenly
+  int stripeSize = 64;
+  while (stripeSize < 4 * (totalSpaces / PLATE_STRIPES) + 64)
   {
-    if (parking[rowCoord][colCoord] == FREE)
-    {
+    stripeSize *= 2;
+  }
 
-      // Update the latest incoming car's registration number
-      strcpy_s(latestIncoming, sizeof(latestIncoming), plate);
-      strcpy_s(parking[rowCoord][colCoord], sizeof(char) * 9, plate);
+  parking = allocate(totalSpaces, sizeof(*parking), MEMORY_LOT);
+  spaceOrder = allocate(totalSpaces, sizeof(int), MEMORY_LOT);
+  spacePosition = allocate(totalSpaces, sizeof(int), MEMORY_LOT);
+  levelOccupied = allocate(config.levels, sizeof(int), MEMORY_LOT);
+  rowWords = (config.columns + 63) / 64;
+  levelRowWords = (config.rows + 63) / 64;
+  freeBits = allocate((size_t)totalRows * rowWords, sizeof(uint64_t), MEMORY_FREE_INDEX);
+  rowFree = allocate(totalRows, sizeof(int), MEMORY_FREE_INDEX);
+  rowBits = allocate((size_t)config.levels * levelRowWords, sizeof(uint64_t), MEMORY_FREE_INDEX);
+  arrivedAt = allocate(totalSpaces, sizeof(TickType_t), MEMORY_ANALYTICS);
+  rowUsage = allocate(totalRows, sizeof(SpaceUsage), MEMORY_ANALYTICS);
+  if (parking == NULL || spaceOrder == NULL || spacePosition == NULL || levelOccupied == NULL || freeBits == NULL ||
+      rowFree == NULL || rowBits == NULL || arrivedAt == NULL || rowUsage == NULL)
+  {
+    return false;
+  }
 
-      logMessage("Car with plate %s assigned to (%d, %d).\n", plate, rowCoord, colCoord);
-      freeSpaces--;
-      return true;
-    }
-    else
+  for (int row = 0; row < totalRows; row++)
+  {
+    for (int column = 0; column < config.columns; column++)
     {
-      logMessage("Requested space (%d, %d) is not free. Assigning random free space...\n", rowCoord, colCoord);
+      freeBits[(size_t)row * rowWords + column / 64] |= 1ull << (column % 64);
     }
+    rowFree[row] = config.columns;
+    rowBits[(size_t)(row / config.rows) * levelRowWords + row % config.rows / 64] |= 1ull << (row % config.rows % 64);
   }
 
-  // Either no specific coordinates provided or requested space wasn't free, find a random free space
-  int allFreeSpaces[ROWS * COLUMNS][2];
-  int freeCount = 0;
+  if (!allocateSnapshot(&snapshots[0]) || !allocateSnapshot(&snapshots[1]) || !allocateSnapshot(&displaySnapshot))
+  {
+    return false;
+  }
 
-  for (int r = 0; r < ROWS; ++r)
+  for (int z = 0; z < zoneCount; z++)
   {
-    for (int c = 0; c < COLUMNS; ++c)
+    LotZone *zone = &zones[z];
+    int firstRow = (int)((int64_t)z * totalRows / zoneCount);
+    int endRow = (int)((int64_t)(z + 1) * totalRows / zoneCount);
+    zone->firstSpace = firstRow * config.columns;
+    zone->spaceCount = (endRow - firstRow) * config.columns;
+    zone->freeSpaces = zone->spaceCount;
+    zone->dirtyLimit = zone->spaceCount < SNAPSHOT_DIRTY_LIMIT ? zone->spaceCount : SNAPSHOT_DIRTY_LIMIT;
+    for (int i = 0; i < 2; i++)
     {
-      if (isParkingSpaceFree(r, c))
+      zone->dirtySpaces[i] = allocate(zone->dirtyLimit, sizeof(int), MEMORY_ZONES);
+      if (zone->dirtySpaces[i] == NULL)
       {
-        allFreeSpaces[freeCount][0] = r;
-        allFreeSpaces[freeCount][1] = c;
-        ++freeCount;
+        return false;
       }
     }
   }
 
-  if (freeCount > 0)
+  for (int i = 0; i < PLATE_STRIPES; i++)
   {
-    int randomIndex = rand() % freeCount;
+    PlateStripe *stripe = &plateStripes[i];
+    stripe->slots = allocate(stripeSize, sizeof(int), MEMORY_PLATE_INDEX);
+    if (stripe->slots == NULL)
+    {
+      return false;
+    }
+    stripe->mask = stripeSize - 1;
+    for (int slot = 0; slot < stripeSize; slot++)
+    {
+      stripe->slots[slot] = -1;
+    }
+  }
 
-    // Update the latest incoming car's registration number
-    strcpy_s(latestIncoming, sizeof(latestIncoming), plate);
-    strcpy_s(parking[allFreeSpaces[randomIndex][0]][allFreeSpaces[randomIndex][1]], sizeof(char) * 9, plate);
+  for (int space = 0; space < totalSpaces; space++)
+  {
+    spaceOrder[space] = space;
+    spacePosition[space] = space;
+  }
+  freeSpaces = totalSpaces;
+  sampleTicks = pdMS_TO_TICKS(config.sampleMs) > 0 ? pdMS_TO_TICKS(config.sampleMs) : 1;
+  return true;
+}
 
-    logMessage("Car with plate %s randomly assigned to (%d, %d).\n", plate, allFreeSpaces[randomIndex][0], allFreeSpaces[randomIndex][1]);
+// Creates a gate's queue and task, returns false if either fails. With no more gates than zones each gate
+// has its own share of the zones, otherwise gates share a zone each.
+bool startGate(Gate *gate, int index, int gateCount, TaskFunction_t task, const char *name)
+{
+  char taskName[configMAX_TASK_NAME_LEN];
+  snprintf(taskName, sizeof(taskName), "%s%d", name, index);
 
-    freeSpaces--;
-    return true;
+  if (gateCount <= zoneCount)
+  {
+    gate->firstZone = index * zoneCount / gateCount;
+    gate->zoneCount = (index + 1) * zoneCount / gateCount - gate->firstZone;
   }
   else
   {
-    logMessage("No free parking spaces available.\n");
+    gate->firstZone = index % zoneCount;
+    gate->zoneCount = 1;
+  }
+  gate->nextZone = gate->firstZone;
+  gate->entrance = zones[gate->firstZone].firstSpace + config.columns / 2; // Middle of the gate's first row
+  gate->random = (uint32_t)rand() | 1;
+
+  gate->events = createQueue(GATE_QUEUE_LENGTH, sizeof(GateEvent), taskName);
+  return gate->events != NULL && startTask(task, taskName, gate, 2, &gate->task);
+}
+
+// Creates every mutex, queue and task, prints the memory budget and runs the scheduler. Returns false
+// straight away if anything can't be created, otherwise once a headless run stops the scheduler.
+bool setup()
+{
+  for (int z = 0; z < zoneCount; z++)
+  {
+    if ((zones[z].mutex = createMutex()) == NULL)
+    {
+      return false;
+    }
+  }
+  for (int i = 0; i < PLATE_STRIPES; i++)
+  {
+    if ((plateStripes[i].mutex = createMutex()) == NULL)
+    {
+      return false;
+    }
+  }
+  if ((recentLogMutex = createMutex()) == NULL || (consoleMutex = createMutex()) == NULL ||
+      (logQueue = createQueue(LOG_QUEUE_LENGTH, sizeof(LogRecord), "log")) == NULL)
+  {
+    return false;
+  }
+  if (config.logPath != NULL && (logFile = fopen(config.logPath, "a")) == NULL)
+  {
+    printf("Failed to open %s, logging to the display only.\n", config.logPath);
+  }
+
+  // Only the display reads snapshots, and publishing one takes every zone lock
+  if (!startTask(loggerTask, "Logger", NULL, tskIDLE_PRIORITY + 1, &loggerTaskHandle) ||
+      (!config.headless && !startTask(snapshotTask, "Snapshot", NULL, 2, &snapshotTaskHandle)))
+  {
+    return false;
+  }
+  for (int g = 0; g < config.entryGates; g++)
+  {
+    if (!startGate(&entryGates[g], g, config.entryGates, entryGateTask, "EntryGate"))
+    {
+      return false;
+    }
+  }
+  for (int g = 0; g < config.exitGates; g++)
+  {
+    if (!startGate(&exitGates[g], g, config.exitGates, exitGateTask, "ExitGate"))
+    {
+      return false;
+    }
+  }
+  if (!startTask(incomingCarsTask, "IncomingCars", NULL, 2, &incomingTaskHandle) ||
+      !startTask(outgoingCarsTask, "OutgoingCars", NULL, 2, &outgoingTaskHandle) ||
+      (config.statsMs > 0 && !startTask(statsTask, "Stats", NULL, 3, &statsTaskHandle)))
+  {
+    return false;
+  }
+  if (config.headless)
+  {
+    if (!startTask(loadReportTask, "LoadReport", NULL, 3, &loadReportTaskHandle))
+    {
+      return false;
+    }
+  }
+  else if ((commandQueue = createQueue(COMMAND_QUEUE_LENGTH, sizeof(ControlCommand), "command")) == NULL ||
+           !startTask(displayParkingTask, "DisplayParking", NULL, 1, &displayTaskHandle) ||
+           !startTask(manualControlTask, "ManualControl", NULL, 1, &manualControlTaskHandle) ||
+           !startTask(controlTask, "Control", NULL, 2, &controlTaskHandle))
+  {
     return false;
   }
+
+  printMemoryBudget();
+  if (!config.headless)
+  {
+    enableRawInput();
+  }
+  vTaskStartScheduler();
+  return true;
 }
 
-void removeCarFromSpace(int row, int col)
+// Queues a log record without formatting anything. Never blocks: when the logger has fallen behind
+// and the queue is full the record is dropped and counted.
+void logEvent(LogEvent event, PlateKey plate, int arg0, int arg1, int arg2, int arg3)
 {
+  // Ensure the queue is created
+  if (logQueue == NULL)
+  {
+    return;
+  }
 
-  // Update the latest outgoing car's registration number
-  strcpy_s(latestOutgoing, sizeof(latestOutgoing), parking[row][col]);
+  LogRecord record = {xTaskGetTickCount(), event, plate, {arg0, arg1, arg2, arg3}};
+  if (xQueueSendToBack(logQueue, &record, 0) == pdPASS)
+  {
+    __atomic_fetch_add(&logCounters.queued, 1, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    __atomic_fetch_add(&logCounters.dropped, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void formatLogRecord(const LogRecord *record, char *line, size_t lineSize)
+{
+  const LogFormat *format = &logFormats[record->event];
+  int length = snprintf(line, lineSize, "[%6lu.%03lu] ", (unsigned long)(record->tick / configTICK_RATE_HZ),
+                        (unsigned long)(record->tick % configTICK_RATE_HZ * 1000 / configTICK_RATE_HZ));
+  if (format->hasPlate)
+  {
+    char plateText[9];
+    decodePlate(record->plate, plateText);
+    snprintf(line + length, lineSize - length, format->format, plateText,
+             record->args[0], record->args[1], record->args[2], record->args[3]);
+  }
+  else
+  {
+    snprintf(line + length, lineSize - length, format->format,
+             record->args[0], record->args[1], record->args[2], record->args[3]);
+  }
+}
 
-  // Mark the parking space as
-  strcpy_s(parking[row][col], sizeof(parking[row][col]), FREE);
+void keepRecentLog(const char *line)
+{
+  xSemaphoreTake(recentLogMutex, portMAX_DELAY);
+  snprintf(recentLogs[recentLogNext], LOG_MESSAGE_LENGTH, "%s", line);
+  recentLogNext = (recentLogNext + 1) % MAX_LOG_MESSAGES;
+  if (recentLogCount < MAX_LOG_MESSAGES)
+  {
+    recentLogCount++;
+  }
+  xSemaphoreGive(recentLogMutex);
+}
+
+// Waits for log records, then formats everything that is already queued and writes it in one go
+void loggerTask(void *params)
+{
+  static char batch[LOG_BATCH * LOG_MESSAGE_LENGTH];
+  LogRecord record;
+
+  while (1)
+  {
+    if (xQueueReceive(logQueue, &record, portMAX_DELAY) != pdTRUE)
+    {
+      continue;
+    }
+
+    unsigned long waiting = uxQueueMessagesWaiting(logQueue) + 1;
+    if (waiting > logCounters.peakFill)
+    {
+      logCounters.peakFill = waiting;
+    }
+
+    size_t length = 0;
+    int count = 0;
+    do
+    {
+      char line[LOG_MESSAGE_LENGTH - 1]; // Leaves room for the newline in the batch
+      formatLogRecord(&record, line, sizeof(line));
+      length += snprintf(batch + length, sizeof(batch) - length, "%s\n", line);
+      count++;
+      keepRecentLog(line);
+    } while (count < LOG_BATCH && xQueueReceive(logQueue, &record, 0) == pdTRUE);
+
+    if (logFile != NULL)
+    {
+      fwrite(batch, 1, length, logFile);
+      fflush(logFile);
+    }
+    __atomic_fetch_add(&logCounters.written, count, __ATOMIC_RELAXED);
+  }
+}
 
-  // Increment the count of free spaces
-  freeSpaces++;
+// Returns the next key press, or -1 straight away if there isn't one, so the calling task can yield
+int readKey()
+{
+  fd_set input;
+  struct timeval noWait = {0, 0};
+  unsigned char key;
+
+  FD_ZERO(&input);
+  FD_SET(STDIN_FILENO, &input);
+  if (select(STDIN_FILENO + 1, &input, NULL, NULL, &noWait) <= 0 || read(STDIN_FILENO, &key, 1) != 1)
+  {
+    return -1;
+  }
+  return key;
+}
 
-  logMessage("Car %s has left from space (%d, %d). Free spaces: %d\n", latestOutgoing, row, col, freeSpaces);
+// Reads a line with echo, polling for keys so other tasks keep running while the operator types
+void readLine(char *buffer, size_t bufferSize)
+{
+  size_t length = 0;
+  while (1)
+  {
+    int key = readKey();
+    if (key == -1)
+    {
+      vTaskDelay(pdMS_TO_TICKS(20));
+      continue;
+    }
+    if (key == '\n' || key == '\r')
+    {
+      break;
+    }
+    if ((key == 127 || key == '\b') && length > 0)
+    {
+      length--;
+      printf("\b \b");
+    }
+    else if (isprint(key) && length + 1 < bufferSize)
+    {
+      buffer[length++] = (char)key;
+      putchar(key);
+    }
+    fflush(stdout);
+  }
+  buffer[length] = '\0';
+  printf("\n");
+}
+
+// Reads a whole number, returns -1 for anything else
+int readNumber()
+{
+  char buffer[16];
+  char *end;
+  readLine(buffer, sizeof(buffer));
+  long value = strtol(buffer, &end, 10);
+  return (end == buffer || *end != '\0') ? -1 : (int)value;
+}
+
+uint64_t monotonicNs()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+// A simple function to get the current system time as a string (HH:MM:SS format)
+void getCurrentTimeString(char *buffer, size_t bufferSize)
+{
+  time_t now = time(NULL);
+  struct tm *tm_info = localtime(&now);
+
+  strftime(buffer, bufferSize, "%H:%M:%S", tm_info);
+}
+
+void generateUKNumberPlate(char *plate)
+{
+  const char *letters = "ABCDEFGHKLMNOPRSVWY";
+  int year = 1 + rand() % 99;    // Years from 2001 to 2099
+  int isSecondHalf = rand() % 2; // Randomly decide if it's the first or second half of the year
+
+  if (isSecondHalf)
+  {
+    year += 50; // Add 50 for registrations in the second half of the year
+  }
+
+  // Adjust year for the actual numbering scheme
+  year = (year % 100) < 50 ? (year % 100) : ((year % 100) - 50);
+
+  // Generate two random letters
+  char firstLetter = letters[rand() % 19];
+  char secondLetter = letters[rand() % 19];
+
+  // Generate three random letters for the suffix
+  char suffix1 = letters[rand() % 19];
+  char suffix2 = letters[rand() % 19];
+  char suffix3 = letters[rand() % 19];
+
+  snprintf(plate, 9, "%c%c%02u %c%c%c", firstLetter, secondLetter, (unsigned)year % 100, suffix1, suffix2, suffix3);
+}
+
+void recordHistogram(Histogram *histogram, uint64_t ns)
+{
+  int bucket = 0;
+  while (bucket < LATENCY_BUCKETS - 1 && ns >= ((uint64_t)1000 << bucket))
+  {
+    bucket++;
+  }
+  histogram->buckets[bucket]++;
+  histogram->count++;
+  histogram->totalNs += ns;
+  if (ns > histogram->maxNs)
+  {
+    histogram->maxNs = ns;
+  }
+}
+
+void mergeHistogram(Histogram *total, const Histogram *histogram)
+{
+  for (int b = 0; b < LATENCY_BUCKETS; b++)
+  {
+    total->buckets[b] += histogram->buckets[b];
+  }
+  total->count += histogram->count;
+  total->totalNs += histogram->totalNs;
+  if (histogram->maxNs > total->maxNs)
+  {
+    total->maxNs = histogram->maxNs;
+  }
+}
+
+// Takes a lock and notes how long it took. The histograms are only touched with the lock held, so they
+// need no atomics of their own.
+void timedTake(SemaphoreHandle_t mutex, LockTimes *times)
+{
+  uint64_t start = monotonicNs();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  times->lockedAt = monotonicNs();
+  recordHistogram(&times->waits, times->lockedAt - start);
+}
+
+void timedGive(SemaphoreHandle_t mutex, LockTimes *times)
+{
+  recordHistogram(&times->holds, monotonicNs() - times->lockedAt);
+  xSemaphoreGive(mutex);
+}
+
+void lockZone(LotZone *zone)
+{
+  timedTake(zone->mutex, &zone->lockTimes);
+}
+
+void unlockZone(LotZone *zone)
+{
+  timedGive(zone->mutex, &zone->lockTimes);
+}
+
+// Takes every zone's lock in order, for work that has to see the whole lot at once. Always returns true,
+// so it reads like the xSemaphoreTake() it stands in for.
+bool lockAllZones()
+{
+  uint64_t start = monotonicNs();
+  for (int z = 0; z < zoneCount; z++)
+  {
+    xSemaphoreTake(zones[z].mutex, portMAX_DELAY);
+  }
+  allZonesLockTimes.lockedAt = monotonicNs();
+  recordHistogram(&allZonesLockTimes.waits, allZonesLockTimes.lockedAt - start);
+  return true;
+}
+
+void unlockAllZones()
+{
+  recordHistogram(&allZonesLockTimes.holds, monotonicNs() - allZonesLockTimes.lockedAt);
+  for (int z = zoneCount - 1; z >= 0; z--)
+  {
+    xSemaphoreGive(zones[z].mutex);
+  }
+}
+
+// Called with the space's zone locked
+bool isParkingSpaceFree(int space)
+{
+  LotZone *zone = spaceZone(space);
+  return spacePosition[space] - zone->firstSpace < zone->freeSpaces;
+}
+
+void swapSpaceOrder(int position, int otherPosition)
+{
+  int space = spaceOrder[position], otherSpace = spaceOrder[otherPosition];
+  spaceOrder[position] = otherSpace;
+  spaceOrder[otherPosition] = space;
+  spacePosition[otherSpace] = position;
+  spacePosition[space] = otherPosition;
+}
+
+uint64_t plateHash(PlateKey plate)
+{
+  return plate * 0x9E3779B97F4A7C15ull;
+}
+
+PlateStripe *plateStripe(PlateKey plate)
+{
+  return &plateStripes[(plateHash(plate) >> 56) % PLATE_STRIPES];
+}
+
+int plateSlot(const PlateStripe *stripe, PlateKey plate)
+{
+  return (int)(plateHash(plate) >> 24) & stripe->mask;
+}
+
+// Called with the stripe locked
+int probeStripe(const PlateStripe *stripe, PlateKey plate)
+{
+  for (int slot = plateSlot(stripe, plate); stripe->slots[slot] != -1; slot = (slot + 1) & stripe->mask)
+  {
+    if (parking[stripe->slots[slot]] == plate)
+    {
+      return stripe->slots[slot];
+    }
+  }
+  return -1;
+}
+
+// Returns the space the car with this plate is parked in, or -1 if it isn't in the lot
+int findCarSpace(PlateKey plate)
+{
+  PlateStripe *stripe = plateStripe(plate);
+  timedTake(stripe->mutex, &stripe->lockTimes);
+  int space = probeStripe(stripe, plate);
+  timedGive(stripe->mutex, &stripe->lockTimes);
+  return space;
+}
+
+// Puts the plate in the space and the index, unless a car with the same plate is already parked
+AssignResult claimPlate(int space, PlateKey plate)
+{
+  PlateStripe *stripe = plateStripe(plate);
+  AssignResult result = ASSIGNED;
+
+  timedTake(stripe->mutex, &stripe->lockTimes);
+  if (probeStripe(stripe, plate) != -1)
+  {
+    result = DUPLICATE_PLATE;
+  }
+  else if (stripe->count == stripe->mask)
+  {
+    result = LOT_FULL; // One slot always stays empty so probes end, only reachable with very uneven plates
+  }
+  else
+  {
+    parking[space] = plate;
+    int slot = plateSlot(stripe, plate);
+    while (stripe->slots[slot] != -1)
+    {
+      slot = (slot + 1) & stripe->mask;
+    }
+    stripe->slots[slot] = space;
+    stripe->count++;
+  }
+  timedGive(stripe->mutex, &stripe->lockTimes);
+  return result;
+}
+
+// Takes the space's car out of the index and empties the space, shifting later entries of the probe run
+// back so no tombstones are needed
+void releasePlate(int space)
+{
+  PlateStripe *stripe = plateStripe(parking[space]);
+  timedTake(stripe->mutex, &stripe->lockTimes);
+
+  int slot = plateSlot(stripe, parking[space]);
+  while (stripe->slots[slot] != space)
+  {
+    slot = (slot + 1) & stripe->mask;
+  }
+
+  int next = (slot + 1) & stripe->mask;
+  while (stripe->slots[next] != -1)
+  {
+    int home = plateSlot(stripe, parking[stripe->slots[next]]);
+    // Move the entry into the hole unless its home lies cyclically in (slot, next]
+    if (((next - home) & stripe->mask) >= ((next - slot) & stripe->mask))
+    {
+      stripe->slots[slot] = stripe->slots[next];
+      slot = next;
+    }
+    next = (next + 1) & stripe->mask;
+  }
+  stripe->slots[slot] = -1;
+  stripe->count--;
+  parking[space] = FREE_PLATE;
+
+  timedGive(stripe->mutex, &stripe->lockTimes);
+}
+
+// Notes a changed space for both snapshot buffers, each catches up with it the next time it is published
+void markSpaceDirty(LotZone *zone, int space)
+{
+  for (int i = 0; i < 2; i++)
+  {
+    if (zone->dirtyCount[i] < zone->dirtyLimit)
+    {
+      zone->dirtySpaces[i][zone->dirtyCount[i]++] = space;
+    }
+    else
+    {
+      zone->fullRefresh[i] = true;
+    }
+  }
+}
+
+// Brings the back buffer up to date and makes it the front one. Called with every zone locked, so
+// readers never see half of a gate's change.
+void publishSnapshot()
+{
+  int back = 1 - frontSnapshot;
+  ParkingSnapshot *snapshot = &snapshots[back];
+
+  __atomic_store_n(&snapshot->generation, snapshot->generation + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  snapshot->latestIncoming = latestIncoming;
+  snapshot->latestOutgoing = latestOutgoing;
+  snapshot->freeSpaces = freeSpaces;
+  for (int z = 0; z < zoneCount; z++)
+  {
+    LotZone *zone = &zones[z];
+    if (zone->fullRefresh[back])
+    {
+      int lastSpace = zone->firstSpace + zone->spaceCount - 1;
+      for (int level = spaceLevel(zone->firstSpace); level <= spaceLevel(lastSpace); level++)
+      {
+        snapshot->levelOccupied[level] = levelOccupied[level];
+      }
+      if (snapshot->grid != NULL)
+      {
+        memcpy(snapshot->grid + zone->firstSpace, (const void *)(parking + zone->firstSpace),
+               zone->spaceCount * sizeof(PlateKey));
+      }
+    }
+    else
+    {
+      for (int i = 0; i < zone->dirtyCount[back]; i++)
+      {
+        int space = zone->dirtySpaces[back][i];
+        snapshot->levelOccupied[spaceLevel(space)] = levelOccupied[spaceLevel(space)];
+        if (snapshot->grid != NULL)
+        {
+          snapshot->grid[space] = parking[space];
+        }
+      }
+    }
+    zone->dirtyCount[back] = 0;
+    zone->fullRefresh[back] = false;
+  }
+
+  __atomic_store_n(&snapshot->generation, snapshot->generation + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&frontSnapshot, back, __ATOMIC_RELEASE);
+}
+
+// Copies the front buffer into copy without taking any lock, retrying if the writer reused the buffer
+// while it was being copied.
+void readSnapshot(ParkingSnapshot *copy)
+{
+  while (1)
+  {
+    ParkingSnapshot *snapshot = &snapshots[__atomic_load_n(&frontSnapshot, __ATOMIC_ACQUIRE)];
+    uint32_t generation = __atomic_load_n(&snapshot->generation, __ATOMIC_ACQUIRE);
+    if ((generation & 1) == 0)
+    {
+      copy->latestIncoming = snapshot->latestIncoming;
+      copy->latestOutgoing = snapshot->latestOutgoing;
+      copy->freeSpaces = snapshot->freeSpaces;
+      memcpy(copy->levelOccupied, snapshot->levelOccupied, config.levels * sizeof(int));
+      if (copy->grid != NULL)
+      {
+        memcpy(copy->grid, snapshot->grid, totalSpaces * sizeof(PlateKey));
+      }
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&snapshot->generation, __ATOMIC_RELAXED) == generation)
+      {
+        return;
+      }
+    }
+    taskYIELD();
+  }
+}
+
+// Updates the free space index for a space that has just been freed or taken. Called with its zone locked.
+// A row's bit in rowBits can share a word with rows of other zones, so it is changed atomically.
+void indexSpace(int space, bool free)
+{
+  int row = space / config.columns, column = space % config.columns;
+  uint64_t *word = &freeBits[(size_t)row * rowWords + column / 64];
+  uint64_t bit = 1ull << (column % 64);
+  __atomic_store_n(word, free ? *word | bit : *word & ~bit, __ATOMIC_RELAXED);
+
+  int rowFreeSpaces = rowFree[row] + (free ? 1 : -1);
+  __atomic_store_n(&rowFree[row], rowFreeSpaces, __ATOMIC_RELAXED);
+  if (rowFreeSpaces == (free ? 1 : 0)) // The row has just stopped or started being full
+  {
+    uint64_t *rows = &rowBits[(size_t)spaceLevel(space) * levelRowWords + spaceRow(space) / 64];
+    uint64_t rowBit = 1ull << (spaceRow(space) % 64);
+    if (free)
+    {
+      __atomic_fetch_or(rows, rowBit, __ATOMIC_RELAXED);
+    }
+    else
+    {
+      __atomic_fetch_and(rows, ~rowBit, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// First set bit at or after from in a bitmap of size bits, or -1 if there is none
+int nextSetBit(const uint64_t *words, int from, int size)
+{
+  if (from >= size)
+  {
+    return -1;
+  }
+  int w = from / 64;
+  uint64_t word = __atomic_load_n(&words[w], __ATOMIC_RELAXED) & (~0ull << (from % 64));
+  while (word == 0)
+  {
+    if (++w * 64 >= size)
+    {
+      return -1;
+    }
+    word = __atomic_load_n(&words[w], __ATOMIC_RELAXED);
+  }
+  return w * 64 + __builtin_ctzll(word); // Bits past size are never set
+}
+
+// Last set bit at or before from, or -1 if there is none
+int previousSetBit(const uint64_t *words, int from)
+{
+  if (from < 0)
+  {
+    return -1;
+  }
+  int w = from / 64;
+  uint64_t word = __atomic_load_n(&words[w], __ATOMIC_RELAXED) & (~0ull >> (63 - from % 64));
+  while (word == 0)
+  {
+    if (--w < 0)
+    {
+      return -1;
+    }
+    word = __atomic_load_n(&words[w], __ATOMIC_RELAXED);
+  }
+  return w * 64 + 63 - __builtin_clzll(word);
+}
+
+// Nearest free space on a level to (row, column) by walking distance, rows plus columns apart, or -1 if the
+// level is full. Rows are visited outwards from the target and the search stops once the next row is
+// further away than the best space found.
+int nearestFreeOnLevel(int level, int row, int column)
+{
+  const uint64_t *rows = &rowBits[(size_t)level * levelRowWords];
+  int best = -1, bestDistance = INT_MAX;
+  int up = previousSetBit(rows, row), down = nextSetBit(rows, row + 1, config.rows);
+
+  while (up != -1 || down != -1)
+  {
+    bool takeUp = down == -1 || (up != -1 && row - up <= down - row);
+    int candidateRow = takeUp ? up : down;
+    int rowDistance = abs(row - candidateRow);
+    if (rowDistance >= bestDistance)
+    {
+      break;
+    }
+
+    const uint64_t *columns = &freeBits[((size_t)level * config.rows + candidateRow) * rowWords];
+    int left = previousSetBit(columns, column), right = nextSetBit(columns, column, config.columns);
+    int nearest = right == -1 || (left != -1 && column - left <= right - column) ? left : right;
+    if (nearest != -1 && rowDistance + abs(column - nearest) < bestDistance)
+    {
+      best = spaceIndex(level, candidateRow, nearest);
+      bestDistance = rowDistance + abs(column - nearest);
+    }
+
+    if (takeUp)
+    {
+      up = previousSetBit(rows, up - 1);
+    }
+    else
+    {
+      down = nextSetBit(rows, down + 1, config.rows);
+    }
+  }
+  return best;
+}
+
+// Nearest free space to target: on the target's level if it has room, otherwise on the closest level that
+// does. Returns -1 if the lot is full. Reads the index without locks, so the space may be gone by the time
+// its zone is locked.
+int nearestFreeSpace(int target)
+{
+  int level = spaceLevel(target), levelSpaces = config.rows * config.columns;
+  for (int offset = 0; offset < config.levels; offset++)
+  {
+    for (int side = 0; side < (offset == 0 ? 1 : 2); side++)
+    {
+      int candidateLevel = side == 0 ? level - offset : level + offset;
+      if (candidateLevel < 0 || candidateLevel >= config.levels ||
+          __atomic_load_n(&levelOccupied[candidateLevel], __ATOMIC_RELAXED) == levelSpaces)
+      {
+        continue;
+      }
+      int space = nearestFreeOnLevel(candidateLevel, spaceRow(target), spaceColumn(target));
+      if (space != -1)
+      {
+        return space;
+      }
+    }
+  }
+  return -1;
+}
+
+// Adds the time since the last change, at the occupancy until now, to a usage integral
+void accrueUsage(SpaceUsage *usage, int occupied, TickType_t now)
+{
+  usage->occupiedTicks += (uint64_t)occupied * (TickType_t)(now - usage->changedAt);
+  usage->changedAt = now;
+}
+
+// Files a change in a zone's occupancy under the current sample, first carrying the occupancy it had
+// through any sample periods it saw no change in. Called with the zone locked.
+void recordOccupancy(LotZone *zone, int occupied, bool arriving, TickType_t now)
+{
+  uint32_t bucket = now / sampleTicks;
+  if (bucket != zone->latestBucket)
+  {
+    int before = arriving ? occupied - 1 : occupied + 1;
+    uint32_t from = bucket - zone->latestBucket > OCCUPANCY_SAMPLES ? bucket - OCCUPANCY_SAMPLES + 1 : zone->latestBucket + 1;
+    for (uint32_t b = from; b <= bucket; b++)
+    {
+      zone->samples[b % OCCUPANCY_SAMPLES] = (OccupancySample){b, before, before, 0, 0};
+    }
+    __atomic_store_n(&zone->latestBucket, bucket, __ATOMIC_RELEASE);
+  }
+
+  OccupancySample *sample = &zone->samples[bucket % OCCUPANCY_SAMPLES];
+  sample->occupied = occupied;
+  if (occupied > sample->peak)
+  {
+    sample->peak = occupied;
+  }
+  if (arriving)
+  {
+    sample->arrivals++;
+  }
+  else
+  {
+    sample->departures++;
+  }
+}
+
+// Brings the usage integrals and occupancy samples up to a car parking in or leaving a space and, as it
+// leaves, files how long it stayed. Called with the zone locked, before the space changes sets.
+void recordUsage(LotZone *zone, int space, bool arriving, TickType_t now)
+{
+  int row = space / config.columns;
+  int zoneOccupied = zone->spaceCount - zone->freeSpaces;
+  accrueUsage(&rowUsage[row], config.columns - rowFree[row], now);
+  accrueUsage(&zone->usage, zoneOccupied, now);
+  recordOccupancy(zone, arriving ? zoneOccupied + 1 : zoneOccupied - 1, arriving, now);
+  if (arriving)
+  {
+    arrivedAt[space] = now;
+  }
+  else
+  {
+    recordHistogram(&zone->dwell, (uint64_t)(TickType_t)(now - arrivedAt[space]) * (1000000000ull / configTICK_RATE_HZ));
+  }
+}
+
+// Raises the peak and its time in one exchange, so a report never pairs one gate's peak with another's tick
+void notePeakOccupancy(int occupied, TickType_t now)
+{
+  uint64_t peak = __atomic_load_n(&peakOccupancy, __ATOMIC_RELAXED);
+  uint64_t raised = (uint64_t)occupied << 32 | (uint32_t)now;
+  while ((int)(peak >> 32) < occupied)
+  {
+    if (__atomic_compare_exchange_n(&peakOccupancy, &peak, raised, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+      return;
+    }
+  }
+}
+
+// Parks a car in a free space, moving the space from its zone's free set to the occupied set. Called with
+// the zone locked.
+AssignResult occupySpace(int space, PlateKey plate)
+{
+  LotZone *zone = spaceZone(space);
+  AssignResult result = claimPlate(space, plate);
+  if (result != ASSIGNED)
+  {
+    return result;
+  }
+
+  TickType_t now = xTaskGetTickCount();
+  recordUsage(zone, space, true, now);
+  swapSpaceOrder(spacePosition[space], zone->firstSpace + zone->freeSpaces - 1);
+  indexSpace(space, false);
+  __atomic_store_n(&zone->freeSpaces, zone->freeSpaces - 1, __ATOMIC_RELAXED);
+  notePeakOccupancy(totalSpaces - __atomic_sub_fetch(&freeSpaces, 1, __ATOMIC_RELAXED), now);
+  __atomic_fetch_add(&levelOccupied[spaceLevel(space)], 1, __ATOMIC_RELAXED);
+  markSpaceDirty(zone, space);
+  return ASSIGNED;
+}
+
+// Empties an occupied space, moving it back to its zone's free set. Called with the zone locked.
+void vacateSpace(int space)
+{
+  LotZone *zone = spaceZone(space);
+  recordUsage(zone, space, false, xTaskGetTickCount());
+  releasePlate(space);
+  swapSpaceOrder(spacePosition[space], zone->firstSpace + zone->freeSpaces);
+  indexSpace(space, true);
+  __atomic_store_n(&zone->freeSpaces, zone->freeSpaces + 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&freeSpaces, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&levelOccupied[spaceLevel(space)], 1, __ATOMIC_RELAXED);
+  markSpaceDirty(zone, space);
+}
+
+// A uniformly random occupied space in the zone, or -1 if it is empty
+int randomOccupiedSpace(const LotZone *zone, uint32_t *random)
+{
+  int occupied = zone->spaceCount - zone->freeSpaces;
+  return occupied > 0 ? spaceOrder[zone->firstSpace + zone->freeSpaces + nextRandom(random) % occupied] : -1;
+}
+
+// Parks a car in the requested space if there is one (non-negative) and it is free, otherwise in the
+// nearest free space to it, or to the entrance when no space was requested. Only ever holds one zone's lock.
+AssignResult assignParkingSpace(PlateKey plate, int requestedSpace, int entrance)
+{
+  if (findCarSpace(plate) != -1)
+  {
+    logEvent(LOG_ALREADY_PARKED, plate, 0, 0, 0, 0);
+    return DUPLICATE_PLATE;
+  }
+
+  // If a specific space is requested (non-negative), try to assign it
+  if (requestedSpace >= 0)
+  {
+    LotZone *zone = spaceZone(requestedSpace);
+    AssignResult result = LOT_FULL;
+    lockZone(zone);
+    if (isParkingSpaceFree(requestedSpace))
+    {
+      result = occupySpace(requestedSpace, plate);
+    }
+    unlockZone(zone);
+
+    if (result == ASSIGNED)
+    {
+      // Update the latest incoming car's registration number
+      __atomic_store_n(&latestIncoming, plate, __ATOMIC_RELAXED);
+      logEvent(LOG_ASSIGNED, plate, spaceLevel(requestedSpace), spaceRow(requestedSpace), spaceColumn(requestedSpace), 0);
+      return ASSIGNED;
+    }
+    if (result == DUPLICATE_PLATE)
+    {
+      logEvent(LOG_ALREADY_PARKED, plate, 0, 0, 0, 0); // Another gate parked the same plate meanwhile
+      return DUPLICATE_PLATE;
+    }
+    logEvent(LOG_REQUESTED_TAKEN, plate, spaceLevel(requestedSpace), spaceRow(requestedSpace), spaceColumn(requestedSpace), 0);
+  }
+
+  // Either no specific space requested or the requested space wasn't free, take the nearest free space
+  int target = requestedSpace >= 0 ? requestedSpace : entrance;
+  int space;
+  while ((space = nearestFreeSpace(target)) != -1)
+  {
+    LotZone *zone = spaceZone(space);
+    lockZone(zone);
+    bool stillFree = isParkingSpaceFree(space);
+    AssignResult result = stillFree ? occupySpace(space, plate) : LOT_FULL;
+    unlockZone(zone);
+
+    if (result == ASSIGNED)
+    {
+      // Update the latest incoming car's registration number
+      __atomic_store_n(&latestIncoming, plate, __ATOMIC_RELAXED);
+      logEvent(LOG_ASSIGNED_NEAREST, plate, spaceLevel(space), spaceRow(space), spaceColumn(space), 0);
+      return ASSIGNED;
+    }
+    if (result == DUPLICATE_PLATE)
+    {
+      logEvent(LOG_ALREADY_PARKED, plate, 0, 0, 0, 0);
+      return DUPLICATE_PLATE;
+    }
+    if (stillFree)
+    {
+      break; // The plate index has no room left
+    }
+    // Another gate took the space between the search and the lock, look again
+  }
+
+  logEvent(LOG_LOT_FULL, plate, 0, 0, 0, 0);
+  return LOT_FULL;
+}
+
+// Called with the space's zone locked
+void removeCarFromSpace(int space)
+{
+  PlateKey plate = parking[space];
+
+  // Mark the parking space as free, which also increments the count of free spaces
+  vacateSpace(space);
+
+  // Update the latest outgoing car's registration number
+  __atomic_store_n(&latestOutgoing, plate, __ATOMIC_RELAXED);
+  logEvent(LOG_CAR_LEFT, plate, spaceLevel(space), spaceRow(space), spaceColumn(space),
+           __atomic_load_n(&freeSpaces, __ATOMIC_RELAXED));
+}
+
+// Lets a random car out, looking through the zones from firstZone on. Returns false if the lot is empty.
+bool removeRandomCar(int firstZone, uint32_t *random)
+{
+  for (int i = 0; i < zoneCount; i++)
+  {
+    LotZone *zone = &zones[(firstZone + i) % zoneCount];
+    if (__atomic_load_n(&zone->freeSpaces, __ATOMIC_RELAXED) == zone->spaceCount)
+    {
+      continue; // Empty
+    }
+
+    lockZone(zone);
+    int space = randomOccupiedSpace(zone, random);
+    if (space != -1)
+    {
+      removeCarFromSpace(space);
+    }
+    unlockZone(zone);
+
+    if (space != -1)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns the space the car was parked in, or -1 if no car with this plate is parked
+int removeCarByPlate(PlateKey plate)
+{
+  int space = findCarSpace(plate);
+  if (space == -1)
+  {
+    return -1;
+  }
+
+  LotZone *zone = spaceZone(space);
+  lockZone(zone);
+  bool parked = parking[space] == plate; // The car may have left between the lookup and the lock
+  if (parked)
+  {
+    removeCarFromSpace(space);
+  }
+  unlockZone(zone);
+  return parked ? space : -1;
+}
+
+// Counts an arrival, and its latency if the car was parked
+void recordArrival(LoadStats *stats, AssignResult result, uint64_t latencyNs)
+{
+  stats->arrivals++;
+  if (result == LOT_FULL)
+  {
+    stats->rejected++;
+    return;
+  }
+  if (result == DUPLICATE_PLATE)
+  {
+    stats->duplicates++;
+    return;
+  }
+
+  recordHistogram(&stats->assignLatency, latencyNs);
+}
+
+// The zone a gate tries first for its next car, taking turns through the gate's own zones
+int nextGateZone(Gate *gate)
+{
+  int zone = gate->nextZone;
+  gate->nextZone = gate->firstZone + (zone - gate->firstZone + 1) % gate->zoneCount;
+  return zone;
+}
+
+// Simulates traffic at the entry gates: a group of cars every arrivalMs, handed to the gates in turn
+void incomingCarsTask(void *params)
+{
+  int gate = 0;
+  while (1)
+  {
+    int carsToEnter = (rand() % 5) + 1; // Randomly choose between 1 to 5 cars entering
+    for (int i = 0; i < carsToEnter; ++i)
+    {
+      char plate[9];
+      generateUKNumberPlate(plate);
+      GateEvent event = {encodePlate(plate), monotonicNs()};
+      xQueueSendToBack(entryGates[gate].events, &event, portMAX_DELAY);
+      gate = (gate + 1) % config.entryGates;
+    }
+
+    // Simulate the time it takes for the next group of cars to arrive
+    vTaskDelay(pdMS_TO_TICKS(config.arrivalMs));
+  }
+}
+
+// Simulates traffic at the exit gates: two cars leave every departureMs
+void outgoingCarsTask(void *params)
+{
+  int gate = 0;
+  while (1)
+  {
+    int carsToRemove = 2; // Number of cars leaving
+    for (int i = 0; i < carsToRemove; ++i)
+    {
+      GateEvent event = {FREE_PLATE, monotonicNs()};
+      xQueueSendToBack(exitGates[gate].events, &event, portMAX_DELAY);
+      gate = (gate + 1) % config.exitGates;
+    }
+
+    // Simulate the time it takes for cars to leave
+    vTaskDelay(pdMS_TO_TICKS(config.departureMs));
+  }
+}
+
+// Tells the snapshot task the lot has changed, if there is one
+void notifySnapshot()
+{
+  if (snapshotTaskHandle != NULL)
+  {
+    xTaskNotifyGive(snapshotTaskHandle);
+  }
 }
 
-void incomingCarsTask(void *params)
+// Parks the cars queued at one entry gate
+void entryGateTask(void *params)
 {
+  Gate *gate = params;
+  GateEvent event;
+
   while (1)
   {
-    int carsToEnter = (rand() % 5) + 1; // Randomly choose between 1 to 5 cars entering
-
-    if (xSemaphoreTake(parkingMutex, portMAX_DELAY) == pdTRUE)
+    if (xQueueReceive(gate->events, &event, portMAX_DELAY) == pdTRUE)
     {
-      for (int i = 0; i < carsToEnter; ++i)
-      {
-
-        char plate[9];
-        generateUKNumberPlate(plate);
-        // assign a random spot
-        assignParkingSpace(plate, -1, -1);
-      }
-      xSemaphoreGive(parkingMutex);
+      AssignResult result = assignParkingSpace(event.plate, -1, gate->entrance);
+      recordArrival(&gate->stats, result, monotonicNs() - event.arrivedAt);
+      notifySnapshot();
     }
-
-    // Simulate the time it takes for the next group of cars to arrive
-    vTaskDelay(pdMS_TO_TICKS(5000));
   }
 }
 
-void outgoingCarsTask(void *params)
+// Lets cars out at one exit gate
+void exitGateTask(void *params)
 {
+  Gate *gate = params;
+  GateEvent event;
+
   while (1)
   {
-    if (xSemaphoreTake(parkingMutex, portMAX_DELAY) == pdTRUE)
+    if (xQueueReceive(gate->events, &event, portMAX_DELAY) == pdTRUE)
     {
-      // Only proceed if there are less than MAX_CARS free spaces, indicating occupancy
-      if (freeSpaces < MAX_CARS)
+      if (removeRandomCar(nextGateZone(gate), &gate->random))
       {
-        int carsToRemove = 2; // Number of cars leaving
-
-        for (int i = 0; i < carsToRemove; ++i)
-        {
-          // Ensure we still have cars to remove
-          if (freeSpaces < MAX_CARS)
-          {
-            int found = 0;
-            int attempts = 0; // To avoid infinite loops in sparse occupancy
-
-            while (!found && attempts < MAX_CARS)
-            {
-              int row = rand() % ROWS;
-              int col = rand() % COLUMNS;
-              if (!isParkingSpaceFree(row, col))
-              {
-                removeCarFromSpace(row, col);
-                found = 1; // An occupied space has been found and cleared
-              }
-              attempts++;
-            }
-
-            if (attempts >= MAX_CARS)
-            {
-              // Could not find a car to remove after checking all spaces
-              logMessage("Attempted to remove a car but none were found.\n");
-              break; // Exit the loop as there may not be enough cars to remove
-            }
-          }
-        }
+        gate->stats.departures++;
+        recordHistogram(&gate->stats.removeLatency, monotonicNs() - event.arrivedAt);
+        notifySnapshot();
       }
       else
       {
-        logMessage("Parking lot is empty. No cars to remove.\n");
+        logEvent(LOG_LOT_EMPTY, FREE_PLATE, 0, 0, 0, 0);
       }
-
-      xSemaphoreGive(parkingMutex);
     }
+  }
+}
 
-    // Simulate the time it takes for cars to leave
-    vTaskDelay(pdMS_TO_TICKS(3000));
+// Publishes a snapshot once gates have notified it of changes, at most every SNAPSHOT_INTERVAL_MS, so the
+// gates never wait on the display and a burst of changes costs one publish
+void snapshotTask(void *params)
+{
+  while (1)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    lockAllZones();
+    publishSnapshot();
+    unlockAllZones();
+
+    vTaskDelay(pdMS_TO_TICKS(SNAPSHOT_INTERVAL_MS));
   }
 }
 
@@ -302,7 +1833,6 @@ bool isValidPlate(const char *plate)
 {
   int len = strlen(plate);
   // Check if length is within the expected range
-  printf("length: %d", len);
   if (len < 7 || len > 8)
   {
     return false;
@@ -320,104 +1850,226 @@ bool isValidPlate(const char *plate)
   return true; // Plate passes basic validation
 }
 
+// Asks for a space by level (only when there is more than one), row and column.
+// Returns the space, or -1 if it isn't in the lot.
+int readSpace(const char *purpose)
+{
+  int level = 0, row, col;
+  if (config.levels > 1)
+  {
+    printf("Enter parking level (0-%d)%s: ", config.levels - 1, purpose);
+    fflush(stdout);
+    level = readNumber();
+  }
+  printf("Enter parking row (0-%d)%s: ", config.rows - 1, purpose);
+  fflush(stdout);
+  row = readNumber();
+  printf("Enter parking column (0-%d)%s: ", config.columns - 1, purpose);
+  fflush(stdout);
+  col = readNumber();
+
+  return isValidSpace(level, row, col) ? spaceIndex(level, row, col) : -1;
+}
+
+// Applies one operator command, locking only the zone it touches
+void applyCommand(const ControlCommand *command)
+{
+  CommandResult *result = command->result;
+  int space = command->space;
+  LotZone *zone;
+
+  switch (command->type)
+  {
+  case COMMAND_ADD:
+    zone = spaceZone(space);
+    lockZone(zone);
+    if (!isParkingSpaceFree(space))
+    {
+      result->status = COMMAND_SPACE_TAKEN;
+    }
+    else
+    {
+      AssignResult assigned = occupySpace(space, command->plate);
+      result->status = assigned == ASSIGNED ? COMMAND_DONE : assigned == DUPLICATE_PLATE ? COMMAND_ALREADY_PARKED : COMMAND_NO_ROOM;
+    }
+    unlockZone(zone);
+    break;
+
+  case COMMAND_REMOVE_SPACE:
+    zone = spaceZone(space);
+    lockZone(zone);
+    if (isParkingSpaceFree(space))
+    {
+      result->status = COMMAND_SPACE_FREE;
+    }
+    else
+    {
+      result->plate = parking[space];
+      removeCarFromSpace(space);
+      result->status = COMMAND_DONE;
+    }
+    unlockZone(zone);
+    break;
+
+  case COMMAND_FIND:
+    result->space = findCarSpace(command->plate);
+    result->status = result->space == -1 ? COMMAND_NOT_PARKED : COMMAND_DONE;
+    break;
+
+  case COMMAND_REMOVE_PLATE:
+    result->space = removeCarByPlate(command->plate);
+    result->status = result->space == -1 ? COMMAND_NOT_PARKED : COMMAND_DONE;
+    break;
+  }
+}
+
+// Applies operator commands as they arrive. Each one holds a single zone lock for a few microseconds, so
+// the gates barely notice the operator.
+void controlTask(void *params)
+{
+  ControlCommand command;
+
+  while (1)
+  {
+    if (xQueueReceive(commandQueue, &command, portMAX_DELAY) == pdTRUE)
+    {
+      applyCommand(&command);
+      xTaskNotifyGive(command.replyTo);
+      notifySnapshot();
+    }
+  }
+}
+
+// Queues a command for the control task and waits until it has been applied
+CommandResult sendCommand(CommandType type, PlateKey plate, int space)
+{
+  CommandResult result = {COMMAND_DONE, -1, FREE_PLATE};
+  ControlCommand command = {type, plate, space, xTaskGetCurrentTaskHandle(), &result};
+
+  xQueueSendToBack(commandQueue, &command, portMAX_DELAY);
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  return result;
+}
+
+// Reads operator input without holding any lot lock and sends it on as commands. The console is taken while
+// the operator types, so the display waits out the prompt between frames; the gates keep running throughout.
 void manualControlTask(void *params)
 {
-  char input;
-  int row, col;
+  int input;
+  int space;
   char plate[9];
+  CommandResult result;
 
   while (1)
   {
-    input = getch(); // Assuming getch() or similar function is available
+    input = readKey();
 
-    if ((input == 'I' || input == 'i') && xSemaphoreTake(parkingMutex, portMAX_DELAY))
+    if (input == 'I' || input == 'i')
     {
-      // Suspend automated car handling tasks
-      vTaskSuspend(incomingTaskHandle);
-      vTaskSuspend(outgoingTaskHandle);
-      vTaskSuspend(displayTaskHandle);
+      xSemaphoreTake(consoleMutex, portMAX_DELAY);
 
       // Manual addition logic
-      printf("Enter parking row (0-4): ");
-      scanf_s("%d", &row);
-      printf("Enter parking column (0-4): ");
-      scanf_s("%d", &col);
+      space = readSpace("");
 
       // Inside the if block for manual addition ('I' or 'i')
       printf("Enter car plate (e.g., AB51 CDE): ");
-      clearInputBuffer();
-      fgets(plate, sizeof(plate), stdin);
-      // Remove the newline character if fgets reads one
-      plate[strcspn(plate, "\n")] = 0;
+      fflush(stdout);
+      readLine(plate, sizeof(plate));
 
-      if (isValidPlate(plate))
+      if (!isValidPlate(plate))
+      {
+        printf("Invalid plate format.\n");
+      }
+      else if (space == -1)
+      {
+        printf("Invalid level, row or column.\n");
+      }
+      else
       {
-        if (row >= 0 && row < ROWS && col >= 0 && col < COLUMNS)
+        result = sendCommand(COMMAND_ADD, encodePlate(plate), space);
+        if (result.status == COMMAND_DONE)
         {
-          if (isParkingSpaceFree(row, col))
-          {
-            strcpy_s(parking[row][col], sizeof(char) * 9, plate);
-            printf("Car %s added manually at (%d, %d).\n", plate, row, col);
-          }
-          else
-          {
-            printf("Space (%d, %d) is already occupied.\n", row, col);
-          }
+          printf("Car %s added manually at (%d, %d, %d).\n", plate, spaceLevel(space), spaceRow(space), spaceColumn(space));
+        }
+        else if (result.status == COMMAND_ALREADY_PARKED)
+        {
+          printf("Car %s is already parked.\n", plate);
+        }
+        else if (result.status == COMMAND_SPACE_TAKEN)
+        {
+          printf("Space (%d, %d, %d) is already occupied.\n", spaceLevel(space), spaceRow(space), spaceColumn(space));
         }
         else
         {
-          printf("Invalid row or column.\n");
+          printf("No room left in the plate index.\n");
         }
       }
-      else
-      {
-        printf("Invalid plate format.\n");
-      }
 
-      xSemaphoreGive(parkingMutex);
-      // Resume tasks
-      vTaskResume(incomingTaskHandle);
-      vTaskResume(outgoingTaskHandle);
-      vTaskResume(displayTaskHandle);
+      xSemaphoreGive(consoleMutex);
     }
-    else if ((input == 'O' || input == 'o') && xSemaphoreTake(parkingMutex, portMAX_DELAY))
+    else if (input == 'O' || input == 'o')
     {
-      // Suspend tasks
-      vTaskSuspend(incomingTaskHandle);
-      vTaskSuspend(outgoingTaskHandle);
-      vTaskSuspend(displayTaskHandle);
+      xSemaphoreTake(consoleMutex, portMAX_DELAY);
 
       // Manual removal logic
-      printf("Enter parking row (0-4) for removal: ");
-      scanf_s("%d", &row);
-      printf("Enter parking column (0-4) for removal: ");
-      scanf_s("%d", &col);
+      space = readSpace(" for removal");
 
-      if (row >= 0 && row < ROWS && col >= 0 && col < COLUMNS)
+      if (space == -1)
+      {
+        printf("Invalid level, row or column.\n");
+      }
+      else
       {
-        if (!isParkingSpaceFree(row, col))
+        result = sendCommand(COMMAND_REMOVE_SPACE, FREE_PLATE, space);
+        if (result.status == COMMAND_DONE)
         {
-          printf("Car %s removed manually from (%d, %d).\n", parking[row][col], row, col);
-          strcpy_s(parking[row][col], sizeof(char) * 9, FREE); // Mark the space as free
+          decodePlate(result.plate, plate);
+          printf("Car %s removed manually from (%d, %d, %d).\n", plate, spaceLevel(space), spaceRow(space), spaceColumn(space));
         }
         else
         {
-          printf("Space (%d, %d) is already free.\n", row, col);
+          printf("Space (%d, %d, %d) is already free.\n", spaceLevel(space), spaceRow(space), spaceColumn(space));
         }
       }
+
+      xSemaphoreGive(consoleMutex);
+    }
+    else if (input == 'F' || input == 'f' || input == 'R' || input == 'r')
+    {
+      bool removing = (input == 'R' || input == 'r');
+
+      xSemaphoreTake(consoleMutex, portMAX_DELAY);
+
+      // Find or remove a car by its plate
+      printf("Enter car plate (e.g., AB51 CDE): ");
+      fflush(stdout);
+      readLine(plate, sizeof(plate));
+
+      if (!isValidPlate(plate))
+      {
+        printf("Invalid plate format.\n");
+      }
       else
       {
-        printf("Invalid row or column.\n");
+        result = sendCommand(removing ? COMMAND_REMOVE_PLATE : COMMAND_FIND, encodePlate(plate), -1);
+        if (result.status == COMMAND_NOT_PARKED)
+        {
+          printf("Car %s is not in the car park.\n", plate);
+        }
+        else
+        {
+          space = result.space;
+          printf("Car %s is parked at (%d, %d, %d).\n", plate, spaceLevel(space), spaceRow(space), spaceColumn(space));
+          if (removing)
+          {
+            printf("Car %s removed manually.\n", plate);
+          }
+        }
       }
 
-      xSemaphoreGive(parkingMutex);
-
-      // Resume tasks
-      vTaskResume(incomingTaskHandle);
-      vTaskResume(outgoingTaskHandle);
-      vTaskResume(displayTaskHandle);
+      xSemaphoreGive(consoleMutex);
     }
-    else if (input == 'ESC')
+    else if (input == KEY_ESCAPE)
     {
       printf("Exiting manual mode.\n");
     }
@@ -426,9 +2078,64 @@ void manualControlTask(void *params)
   }
 }
 
-void displayOutput()
+// Usage integral up to now, read without the zone lock
+uint64_t usageUntil(const SpaceUsage *usage, int occupied, TickType_t now)
+{
+  return usage->occupiedTicks + (uint64_t)occupied * (TickType_t)(now - usage->changedAt);
+}
+
+double utilization(uint64_t occupiedTicks, int spaces, TickType_t now)
+{
+  return now > 0 ? 100.0 * occupiedTicks / ((double)spaces * now) : 0.0;
+}
+
+// Merges the zones' occupancy rings up to now without taking their locks. A zone with no sample for a
+// period saw no change since before it, so its current occupancy stands in.
+void mergeOccupancy(OccupancySeries *series, TickType_t now)
+{
+  uint32_t bucket = now / sampleTicks;
+  series->count = bucket + 1 < OCCUPANCY_SAMPLES ? (int)bucket + 1 : OCCUPANCY_SAMPLES;
+  series->firstBucket = bucket + 1 - series->count;
+  memset(series->occupied, 0, sizeof(series->occupied));
+  memset(series->arrivals, 0, sizeof(series->arrivals));
+
+  for (int z = 0; z < zoneCount; z++)
+  {
+    const LotZone *zone = &zones[z];
+    uint32_t latest = __atomic_load_n(&zone->latestBucket, __ATOMIC_ACQUIRE);
+    int occupied = zone->spaceCount - __atomic_load_n(&zone->freeSpaces, __ATOMIC_RELAXED);
+    for (int i = 0; i < series->count; i++)
+    {
+      uint32_t b = series->firstBucket + i;
+      const OccupancySample *sample = &zone->samples[b % OCCUPANCY_SAMPLES];
+      if (sample->bucket == b)
+      {
+        series->occupied[i] += sample->occupied;
+        series->arrivals[i] += sample->arrivals;
+      }
+      else if (latest < b)
+      {
+        series->occupied[i] += occupied;
+      }
+    }
+  }
+}
+
+// One mark per sample for the latest samples, from ' ' for empty to '@' for full
+void printOccupancyLine(FILE *out, const OccupancySeries *series, int samples)
+{
+  static const char marks[] = " .:-=+*#%@";
+  int first = series->count > samples ? series->count - samples : 0;
+  for (int i = first; i < series->count; i++)
+  {
+    int occupied = series->occupied[i];
+    fputc(marks[((int64_t)occupied * 9 + totalSpaces - 1) / totalSpaces], out);
+  }
+}
+
+void displayOutput(const ParkingSnapshot *view)
 {
-  system("cls"); // Clear the console
+  printf("\x1b[2J\x1b[H"); // Clear the console and move the cursor home
 
   char timeString[9]; // Enough space for HH:MM:SS\0
   getCurrentTimeString(timeString, sizeof(timeString));
@@ -436,49 +2143,431 @@ void displayOutput()
   // Display the header
   printf(ANSI_COLOR_CYAN "                    Smart Parking Monitoring System\n" ANSI_COLOR_RESET);
   printf("==========================================================================\n\n");
-  printf(ANSI_COLOR_GREEN "Latest Incoming Car: %s\n" ANSI_COLOR_RESET, latestIncoming);
-  printf(ANSI_COLOR_RED "Latest Outgoing Car: %s\n" ANSI_COLOR_RESET, latestOutgoing);
-  printf("\n================= Parking Spaces: %d/%d (%d spaces left) ==================\n\n", MAX_CARS - freeSpaces, MAX_CARS, freeSpaces);
-
-  // Parking grid with better spacing and color
-  for (int i = 0; i < ROWS; i++)
+  char plateText[9];
+  decodePlate(view->latestIncoming, plateText);
+  printf(ANSI_COLOR_GREEN "Latest Incoming Car: %s\n" ANSI_COLOR_RESET, plateText);
+  decodePlate(view->latestOutgoing, plateText);
+  printf(ANSI_COLOR_RED "Latest Outgoing Car: %s\n" ANSI_COLOR_RESET, plateText);
+  printf("\n================= Parking Spaces: %d/%d (%d spaces left) ==================\n\n", totalSpaces - view->freeSpaces, totalSpaces, view->freeSpaces);
+
+  for (int level = 0; level < config.levels; level++)
   {
-    for (int j = 0; j < COLUMNS; j++)
+    int levelSpaces = config.rows * config.columns;
+    if (config.levels > 1)
     {
-      if (isParkingSpaceFree(i, j))
-      {
-        printf(ANSI_COLOR_GREEN "[    FREE    ] " ANSI_COLOR_RESET);
-      }
-      else
+      printf("Level %d: %d/%d\n", level, view->levelOccupied[level], levelSpaces);
+    }
+    if (view->grid == NULL)
+    {
+      continue; // Too many spaces to draw, the per level totals have to do
+    }
+
+    // Parking grid with better spacing and color
+    for (int i = 0; i < config.rows; i++)
+    {
+      for (int j = 0; j < config.columns; j++)
       {
-        printf(ANSI_COLOR_RED "[  %-10s] " ANSI_COLOR_RESET, parking[i][j]); // Fixed width for registration number
+        int space = spaceIndex(level, i, j);
+        if (view->grid[space] == FREE_PLATE)
+        {
+          printf(ANSI_COLOR_GREEN "[    FREE    ] " ANSI_COLOR_RESET);
+        }
+        else
+        {
+          decodePlate(view->grid[space], plateText);
+          printf(ANSI_COLOR_RED "[  %-10s] " ANSI_COLOR_RESET, plateText); // Fixed width for registration number
+        }
       }
+      printf("\n");
     }
     printf("\n");
   }
+  OccupancySeries series;
+  mergeOccupancy(&series, xTaskGetTickCount());
+  printf("Occupancy, one mark per %d ms: [", config.sampleMs);
+  printOccupancyLine(stdout, &series, PEAK_WINDOW_SAMPLES);
+  printf("] peak %d\n\n", (int)(__atomic_load_n(&peakOccupancy, __ATOMIC_RELAXED) >> 32));
+
+  // Recent events, oldest first
+  char recent[MAX_LOG_MESSAGES][LOG_MESSAGE_LENGTH];
+  int recentCount;
+  xSemaphoreTake(recentLogMutex, portMAX_DELAY);
+  recentCount = recentLogCount;
+  for (int i = 0; i < recentCount; i++)
+  {
+    memcpy(recent[i], recentLogs[(recentLogNext - recentCount + i + MAX_LOG_MESSAGES) % MAX_LOG_MESSAGES], LOG_MESSAGE_LENGTH);
+  }
+  xSemaphoreGive(recentLogMutex);
+
+  printf("Recent events (log: %lu written, %lu dropped):\n", __atomic_load_n(&logCounters.written, __ATOMIC_RELAXED),
+         __atomic_load_n(&logCounters.dropped, __ATOMIC_RELAXED));
+  for (int i = 0; i < recentCount; i++)
+  {
+    printf("  %s\n", recent[i]);
+  }
+
   printf("\n===============================");
   printf(ANSI_COLOR_YELLOW " [%s] " ANSI_COLOR_RESET, timeString);
   printf("===============================\n");
+  fflush(stdout);
 }
 
 void displayParkingTask(void *params)
 {
   while (1)
   {
-    if (xSemaphoreTake(parkingMutex, portMAX_DELAY) == pdTRUE)
+    // Printing takes far longer than a car does, so it works from a copy and never holds up the car tasks
+    readSnapshot(&displaySnapshot);
+    xSemaphoreTake(consoleMutex, portMAX_DELAY);
+    displayOutput(&displaySnapshot);
+    xSemaphoreGive(consoleMutex);
+
+    vTaskDelay(pdMS_TO_TICKS(1000)); // Update every second
+  }
+}
+
+// Upper bound in microseconds of the bucket holding the given share of the durations
+unsigned long histogramPercentile(const Histogram *histogram, double fraction)
+{
+  unsigned long seen = 0;
+  for (int b = 0; b < LATENCY_BUCKETS; b++)
+  {
+    seen += histogram->buckets[b];
+    if (seen > 0 && seen >= fraction * histogram->count)
+    {
+      return 1ul << b;
+    }
+  }
+  return 0;
+}
+
+void printHistogram(FILE *out, const char *name, const Histogram *histogram)
+{
+  fprintf(out, "%-20s %9lu  mean %8.2f us  p50 < %6lu us  p99 < %6lu us  max %9.2f us\n", name, histogram->count,
+          histogram->count ? histogram->totalNs / 1000.0 / histogram->count : 0.0,
+          histogramPercentile(histogram, 0.50), histogramPercentile(histogram, 0.99), histogram->maxNs / 1000.0);
+}
+
+// Prints occupancy over the last samples, the busiest window, dwell times and row and zone utilization, all
+// from what the gates have kept up to date rather than from the lot
+void printAnalytics(FILE *out)
+{
+  TickType_t now = xTaskGetTickCount();
+  OccupancySeries series;
+  mergeOccupancy(&series, now);
+
+  fprintf(out, "Occupancy, one mark per %d ms: [", config.sampleMs);
+  printOccupancyLine(out, &series, OCCUPANCY_SAMPLES);
+  uint64_t peak = __atomic_load_n(&peakOccupancy, __ATOMIC_RELAXED);
+  fprintf(out, "]\nOccupied now %d of %d, peak %d at %.3f s\n", totalSpaces - __atomic_load_n(&freeSpaces, __ATOMIC_RELAXED),
+          totalSpaces, (int)(peak >> 32), (double)(uint32_t)peak / configTICK_RATE_HZ);
+
+  // Sliding window over the arrivals per sample
+  int window = series.count < PEAK_WINDOW_SAMPLES ? series.count : PEAK_WINDOW_SAMPLES;
+  int arrivals = 0, busiest = 0, busiestStart = 0;
+  for (int i = 0; i < series.count; i++)
+  {
+    arrivals += series.arrivals[i];
+    if (i >= window)
+    {
+      arrivals -= series.arrivals[i - window];
+    }
+    if (i >= window - 1 && arrivals > busiest)
+    {
+      busiest = arrivals;
+      busiestStart = i - window + 1;
+    }
+  }
+  double sampleSeconds = (double)sampleTicks / configTICK_RATE_HZ;
+  fprintf(out, "Busiest %d samples: %d arrivals, %.1f s to %.1f s\n", window, busiest,
+          (series.firstBucket + busiestStart) * sampleSeconds, (series.firstBucket + busiestStart + window) * sampleSeconds);
+
+  Histogram dwell = {0};
+  for (int z = 0; z < zoneCount; z++)
+  {
+    mergeHistogram(&dwell, &zones[z].dwell);
+  }
+  fprintf(out, "Dwell time %9lu cars  mean %8.3f s  p50 < %8.3f s  p99 < %8.3f s  max %8.3f s\n", dwell.count,
+          dwell.count ? dwell.totalNs / 1e9 / dwell.count : 0.0, histogramPercentile(&dwell, 0.50) / 1e6,
+          histogramPercentile(&dwell, 0.99) / 1e6, dwell.maxNs / 1e9);
+
+  fprintf(out, "Zone utilization %%:");
+  for (int z = 0; z < zoneCount; z++)
+  {
+    const LotZone *zone = &zones[z];
+    int occupied = zone->spaceCount - __atomic_load_n(&zone->freeSpaces, __ATOMIC_RELAXED);
+    fprintf(out, "%s %5.1f", z % 16 == 0 && z > 0 ? "\n                   " : "",
+            utilization(usageUntil(&zone->usage, occupied, now), zone->spaceCount, now));
+  }
+
+  int totalRows = config.levels * config.rows, busiestRow = 0, quietestRow = 0;
+  double busiestUse = -1, quietestUse = 101;
+  for (int row = 0; row < totalRows; row++)
+  {
+    double use = utilization(usageUntil(&rowUsage[row], config.columns - rowFree[row], now), config.columns, now);
+    if (use > busiestUse)
+    {
+      busiestUse = use;
+      busiestRow = row;
+    }
+    if (use < quietestUse)
     {
-      displayOutput();
+      quietestUse = use;
+      quietestRow = row;
+    }
+  }
+  fprintf(out, "\nBusiest row: level %d row %d, %.1f%% used. Quietest: level %d row %d, %.1f%% used\n",
+          busiestRow / config.rows, busiestRow % config.rows, busiestUse, quietestRow / config.rows,
+          quietestRow % config.rows, quietestUse);
+}
 
-      xSemaphoreGive(parkingMutex);
+void addLoadStats(LoadStats *total, const LoadStats *gate)
+{
+  total->arrivals += gate->arrivals;
+  total->rejected += gate->rejected;
+  total->duplicates += gate->duplicates;
+  total->departures += gate->departures;
+  mergeHistogram(&total->assignLatency, &gate->assignLatency);
+  mergeHistogram(&total->removeLatency, &gate->removeLatency);
+}
+
+// Prints CPU use since the previous dump and stack headroom per task, lock contention, queue fill, gate
+// latency and the occupancy analytics. Counters are read without locks, so a dump can be a few events behind.
+void printStats(FILE *out, StatsSample *previous)
+{
+  TaskStatus_t tasks[STATS_MAX_TASKS];
+  uint32_t totalRunTime;
+  int count = uxTaskGetSystemState(tasks, STATS_MAX_TASKS, &totalRunTime);
+  uint32_t elapsed = totalRunTime - previous->totalRunTime;
+
+  fprintf(out, "\nStats at %.3f s\n", (double)xTaskGetTickCount() / configTICK_RATE_HZ);
+  fprintf(out, "%-16s %4s %7s %11s\n", "Task", "Prio", "CPU %", "Stack free");
+  for (int i = 0; i < count; i++)
+  {
+    uint32_t runTime = tasks[i].ulRunTimeCounter;
+    for (int j = 0; j < previous->count; j++)
+    {
+      if (previous->handles[j] == tasks[i].xHandle)
+      {
+        runTime -= previous->runTime[j];
+        break;
+      }
     }
+    fprintf(out, "%-16s %4lu %7.1f %11lu\n", tasks[i].pcTaskName, (unsigned long)tasks[i].uxCurrentPriority,
+            elapsed ? 100.0 * runTime / elapsed : 0.0, (unsigned long)tasks[i].usStackHighWaterMark);
+  }
+  previous->count = count;
+  previous->totalRunTime = totalRunTime;
+  for (int i = 0; i < count; i++)
+  {
+    previous->handles[i] = tasks[i].xHandle;
+    previous->runTime[i] = tasks[i].ulRunTimeCounter;
+  }
 
-    vTaskDelay(pdMS_TO_TICKS(1000)); // Update every second
+  Histogram zoneWaits = {0}, zoneHolds = {0}, stripeWaits = {0}, stripeHolds = {0};
+  int busiestZone = 0;
+  for (int z = 0; z < zoneCount; z++)
+  {
+    mergeHistogram(&zoneWaits, &zones[z].lockTimes.waits);
+    mergeHistogram(&zoneHolds, &zones[z].lockTimes.holds);
+    if (zones[z].lockTimes.waits.totalNs > zones[busiestZone].lockTimes.waits.totalNs)
+    {
+      busiestZone = z;
+    }
+  }
+  for (int i = 0; i < PLATE_STRIPES; i++)
+  {
+    mergeHistogram(&stripeWaits, &plateStripes[i].lockTimes.waits);
+    mergeHistogram(&stripeHolds, &plateStripes[i].lockTimes.holds);
+  }
+  printHistogram(out, "Zone lock wait", &zoneWaits);
+  printHistogram(out, "Zone lock hold", &zoneHolds);
+  printHistogram(out, "Stripe lock wait", &stripeWaits);
+  printHistogram(out, "Stripe lock hold", &stripeHolds);
+  printHistogram(out, "All zones wait", &allZonesLockTimes.waits);
+  printHistogram(out, "All zones hold", &allZonesLockTimes.holds);
+  fprintf(out, "Most waited for zone: %d (rows from %d), %.2f ms in total\n", busiestZone,
+          zones[busiestZone].firstSpace / config.columns, zones[busiestZone].lockTimes.waits.totalNs / 1e6);
+
+  LoadStats gates = {0};
+  fprintf(out, "Entry gate queues:");
+  for (int g = 0; g < config.entryGates; g++)
+  {
+    fprintf(out, " %lu", (unsigned long)uxQueueMessagesWaiting(entryGates[g].events));
+    addLoadStats(&gates, &entryGates[g].stats);
+  }
+  fprintf(out, "\nExit gate queues:");
+  for (int g = 0; g < config.exitGates; g++)
+  {
+    fprintf(out, " %lu", (unsigned long)uxQueueMessagesWaiting(exitGates[g].events));
+    addLoadStats(&gates, &exitGates[g].stats);
+  }
+  fprintf(out, "\nLog queue: %lu of %d waiting, peak %lu, %lu dropped\n", (unsigned long)uxQueueMessagesWaiting(logQueue),
+          LOG_QUEUE_LENGTH, logCounters.peakFill, __atomic_load_n(&logCounters.dropped, __ATOMIC_RELAXED));
+  printHistogram(out, "Assignment latency", &gates.assignLatency);
+  printHistogram(out, "Removal latency", &gates.removeLatency);
+  printAnalytics(out);
+  fflush(out);
+}
+
+// Dumps the stats every statsMs: to stdout in a headless run, otherwise to stderr so it can be
+// redirected away from the display
+void statsTask(void *params)
+{
+  static StatsSample previous;
+  FILE *out = config.headless ? stdout : stderr;
+  TickType_t lastWake = xTaskGetTickCount();
+
+  while (1)
+  {
+    xTaskDelayUntil(&lastWake, pdMS_TO_TICKS(config.statsMs));
+    printStats(out, &previous);
+  }
+}
+
+// Waits out a headless run, prints the report and stops the scheduler
+void loadReportTask(void *params)
+{
+  uint64_t startedAt = monotonicNs();
+  vTaskDelay(pdMS_TO_TICKS(config.seconds * 1000));
+
+  // The gates' counters are read with every zone locked, which stops all but a car already past its zone
+  LoadStats stats = {0};
+  int occupied = 0;
+  if (lockAllZones())
+  {
+    for (int g = 0; g < config.entryGates; g++)
+    {
+      addLoadStats(&stats, &entryGates[g].stats);
+    }
+    for (int g = 0; g < config.exitGates; g++)
+    {
+      addLoadStats(&stats, &exitGates[g].stats);
+    }
+    occupied = totalSpaces - freeSpaces;
+    unlockAllZones();
   }
+  double seconds = (monotonicNs() - startedAt) / 1e9;
+
+  printf("\nLoad test\n------\n");
+  printf("Lot: %d levels x %d rows x %d columns = %d spaces, %d occupied at the end\n",
+         config.levels, config.rows, config.columns, totalSpaces, occupied);
+  printf("Gates: %d entry, %d exit over %d zones\n", config.entryGates, config.exitGates, zoneCount);
+  printf("Arrivals every %d ms, departures every %d ms, ran %.2f s\n", config.arrivalMs, config.departureMs, seconds);
+  printf("Cars: %lu arrived (%lu turned away full, %lu duplicate plates), %lu left\n",
+         stats.arrivals, stats.rejected, stats.duplicates, stats.departures);
+  printf("Throughput: %.0f car operations/sec\n", (stats.arrivals + stats.departures) / seconds);
+  printHistogram(stdout, "Assignment latency", &stats.assignLatency);
+  printHistogram(stdout, "Removal latency", &stats.removeLatency);
+  printf("Log: %lu queued, %lu written, %lu dropped\n", __atomic_load_n(&logCounters.queued, __ATOMIC_RELAXED),
+         __atomic_load_n(&logCounters.written, __ATOMIC_RELAXED), __atomic_load_n(&logCounters.dropped, __ATOMIC_RELAXED));
+
+  StatsSample wholeRun = {0}; // CPU use over the whole run rather than since the last dump
+  printStats(stdout, &wholeRun);
+
+  vTaskEndScheduler();
+  vTaskDelete(NULL);
+}
+
+void printUsage(const char *program)
+{
+  printf("Usage: %s [--levels N] [--rows N] [--columns N] [--headless] [--arrival-ms N] [--departure-ms N] [--entry-gates N] [--exit-gates N] [--seconds N] [--stats-ms N] [--sample-ms N] [--log PATH]\n", program);
+  printf("  --levels, --rows, --columns N  lot size (default 1 x 5 x 5, at most %d spaces)\n", MAX_SPACES);
+  printf("  --headless        no display or manual control, print a throughput and latency report\n");
+  printf("  --arrival-ms N    pause between groups of incoming cars (default 5000)\n");
+  printf("  --departure-ms N  pause between groups of outgoing cars (default 3000)\n");
+  printf("  --entry-gates N   gate tasks parking arriving cars (default 1, at most %d)\n", MAX_GATES);
+  printf("  --exit-gates N    gate tasks letting cars out (default 1, at most %d)\n", MAX_GATES);
+  printf("  --seconds N       length of a headless run (default 10)\n");
+  printf("  --stats-ms N      dump task, lock, queue and latency stats every N ms, to stderr unless headless\n");
+  printf("  --sample-ms N     length of an occupancy sample (default 1000, 60000 makes the busiest window an hour)\n");
+  printf("  --log PATH        append the event log to PATH\n");
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-  setup();
-  for (;;)
-    ;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--headless") == 0)
+    {
+      config.headless = true;
+    }
+    else if (strcmp(argv[i], "--levels") == 0 && i + 1 < argc)
+    {
+      config.levels = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc)
+    {
+      config.rows = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--columns") == 0 && i + 1 < argc)
+    {
+      config.columns = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--arrival-ms") == 0 && i + 1 < argc)
+    {
+      config.arrivalMs = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--departure-ms") == 0 && i + 1 < argc)
+    {
+      config.departureMs = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--entry-gates") == 0 && i + 1 < argc)
+    {
+      config.entryGates = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--exit-gates") == 0 && i + 1 < argc)
+    {
+      config.exitGates = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+    {
+      config.seconds = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--stats-ms") == 0 && i + 1 < argc)
+    {
+      config.statsMs = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--sample-ms") == 0 && i + 1 < argc)
+    {
+      config.sampleMs = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc)
+    {
+      config.logPath = argv[++i];
+    }
+    else
+    {
+      printUsage(argv[0]);
+      return 1;
+    }
+  }
+  if (config.arrivalMs < 0 || config.departureMs < 0 || config.seconds <= 0 || config.statsMs < 0 || config.sampleMs <= 0 ||
+      config.levels <= 0 ||
+      config.entryGates < 1 || config.entryGates > MAX_GATES || config.exitGates < 1 || config.exitGates > MAX_GATES ||
+      config.rows <= 0 || config.columns <= 0 || (long)config.levels * config.rows * config.columns > MAX_SPACES)
+  {
+    printUsage(argv[0]);
+    return 1;
+  }
+#ifdef STATIC_ALLOCATION
+  if (config.levels > STATIC_LEVELS || config.rows > STATIC_ROWS || config.columns > STATIC_COLUMNS)
+  {
+    printf("This build has room for at most %d levels x %d rows x %d columns.\n", STATIC_LEVELS, STATIC_ROWS, STATIC_COLUMNS);
+    return 1;
+  }
+#endif
+
+  if (!createLot())
+  {
+    printf("Failed to allocate a lot of %d x %d x %d spaces.\n", config.levels, config.rows, config.columns);
+    return 1;
+  }
+
+  srand(time(NULL));
+  if (!setup()) // Returns once a headless run stops the scheduler
+  {
+    return 1;
+  }
+  return 0;
 }